@@ -0,0 +1,56 @@
+#pragma once
+#include "../headers/simple_nn.h"
+using namespace std;
+using namespace simple_nn;
+using namespace Eigen;
+
+// Helpers shared by the microbenchmarks in this directory. Each benchmark is built from the
+// project directory like main.cpp, e.g.
+//   g++ bench/im2col.cpp --std=c++17 -I ../include -O2 -pthread -o bench_im2col
+
+// Mean time of f in milliseconds over iters calls, after one warm-up call.
+template<typename F>
+double time_ms(const F& f, int iters)
+{
+	f();
+	auto start = steady_clock::now();
+	for (int i = 0; i < iters; i++) {
+		f();
+	}
+	return duration<double, milli>(steady_clock::now() - start).count() / iters;
+}
+
+MatXf random_matrix(int rows, int cols, unsigned seed)
+{
+	default_random_engine e(seed);
+	normal_distribution<float> dist(0.f, 1.f);
+	MatXf m(rows, cols);
+	std::for_each(m.data(), m.data() + m.size(), [&](float& elem) { elem = dist(e); });
+	return m;
+}
+
+float max_abs_diff(const MatXf& a, const MatXf& b)
+{
+	return (a - b).cwiseAbs().maxCoeff();
+}
+
+// Places output, delta and the scratch buffers of a set layer in memory of its own, in place of
+// the arena of SimpleNN::compile.
+vector<float> place_buffers(Layer& l)
+{
+	vector<Buffer> bufs = l.buffers();
+	bufs.push_back(make_buffer(l.output, Lifetime::STEP));
+	bufs.push_back(make_buffer(l.delta, Lifetime::STEP));
+
+	auto floats = [](size_t bytes) { return (bytes + sizeof(float) - 1) / sizeof(float); };
+	size_t total = 0;
+	for (const Buffer& b : bufs) total += floats(b.bytes);
+	vector<float> mem(total);
+
+	size_t offset = 0;
+	for (const Buffer& b : bufs) {
+		b.place((char*)(mem.data() + offset));
+		offset += floats(b.bytes);
+	}
+	return mem;
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+// im2col and col2im against the per-element loops they replaced, on the input of every
+// convolution of LeNet-5 (main.cpp) for a batch of 32 images.
+#include "bench.h"
+
+// The previous implementation (Caffe's), which bounds-checks and divides per element.
+float old_im2col_get_pixel(const float* im, int height, int width, int channels,
+                        int row, int col, int channel, int pad)
+{
+    row -= pad;
+    col -= pad;
+
+    if (row < 0 || col < 0 || row >= height || col >= width) return 0;
+    return im[col + width * (row + height * channel)];
+}
+
+void old_im2col(const float* data_im, int channels, int height, int width,
+            int ksize, int stride, int pad, int dilation, float* data_col, int col_stride)
+{
+    int c, h, w;
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+
+    int channels_col = channels * ksize * ksize;
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        for (h = 0; h < height_col; ++h) {
+            for (w = 0; w < width_col; ++w) {
+                int im_row = h_offset * dilation + h * stride;
+                int im_col = w_offset * dilation + w * stride;
+                int col_index = c * col_stride + h * width_col + w;
+                data_col[col_index] = old_im2col_get_pixel(data_im, height, width, channels,
+                    im_row, im_col, c_im, pad);
+            }
+        }
+    }
+}
+
+void old_col2im_add_pixel(float* im, int height, int width, int channels,
+                    int row, int col, int channel, int pad, float val)
+{
+    row -= pad;
+    col -= pad;
+
+    if (row < 0 || col < 0 || row >= height || col >= width) return;
+    im[col + width * (row + height * channel)] += val;
+}
+
+void old_col2im(const float* data_col, int channels, int height, int width,
+            int ksize, int stride, int pad, int dilation, float* data_im, int col_stride)
+{
+    int c, h, w;
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+
+    int channels_col = channels * ksize * ksize;
+    for (c = 0; c < channels_col; ++c) {
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        for (h = 0; h < height_col; ++h) {
+            for (w = 0; w < width_col; ++w) {
+                int im_row = h_offset * dilation + h * stride;
+                int im_col = w_offset * dilation + w * stride;
+                int col_index = c * col_stride + h * width_col + w;
+                float val = data_col[col_index];
+                old_col2im_add_pixel(data_im, height, width, channels,
+                    im_row, im_col, c_im, pad, val);
+            }
+        }
+    }
+}
+
+struct ConvShape
+{
+	string name;
+	int channels;
+	int size;
+	int kernel_size;
+	int pad;
+};
+
+int main()
+{
+	int batch = 32, iters = 50;
+	vector<ConvShape> shapes = {
+		{ "conv1 1x28x28 k5 p2", 1, 28, 5, 2 },
+		{ "conv2 6x14x14 k5 p0", 6, 14, 5, 0 }
+	};
+
+	cout << "im2col and col2im of " << batch << " images, ms (old -> new)" << endl;
+	for (const ConvShape& s : shapes) {
+		int out = calc_outsize(s.size, s.kernel_size, 1, s.pad);
+		int ohw = out * out;
+		int rows = s.channels * s.kernel_size * s.kernel_size;
+		int ld = batch * ohw;
+		MatXf im = random_matrix(batch * s.channels, s.size * s.size, 1);
+		MatXf cols = random_matrix(rows, ld, 2);
+		MatXf old_cols(rows, ld), new_cols(rows, ld);
+		MatXf old_im(batch * s.channels, s.size * s.size), new_im(batch * s.channels, s.size * s.size);
+
+		// the samples are unfolded side by side, as Conv2d does for a sub-batch; both write every
+		// column element and add into images cleared before
+		auto run_old_im2col = [&]() {
+			for (int n = 0; n < batch; n++) {
+				old_im2col(im.row(s.channels * n).data(), s.channels, s.size, s.size, s.kernel_size, 1, s.pad, 1,
+					old_cols.data() + ohw * n, ld);
+			}
+		};
+		auto run_new_im2col = [&]() {
+			for (int n = 0; n < batch; n++) {
+				im2col(im.row(s.channels * n).data(), s.channels, s.size, s.size, s.kernel_size, 1, s.pad, 1,
+					new_cols.data() + ohw * n, ld);
+			}
+		};
+		auto run_old_col2im = [&]() {
+			old_im.setZero();
+			for (int n = 0; n < batch; n++) {
+				old_col2im(cols.data() + ohw * n, s.channels, s.size, s.size, s.kernel_size, 1, s.pad, 1,
+					old_im.row(s.channels * n).data(), ld);
+			}
+		};
+		auto run_new_col2im = [&]() {
+			new_im.setZero();
+			for (int n = 0; n < batch; n++) {
+				col2im(cols.data() + ohw * n, s.channels, s.size, s.size, s.kernel_size, 1, s.pad, 1,
+					new_im.row(s.channels * n).data(), ld);
+			}
+		};
+
+		double t_old_im2col = time_ms(run_old_im2col, iters);
+		double t_new_im2col = time_ms(run_new_im2col, iters);
+		double t_old_col2im = time_ms(run_old_col2im, iters);
+		double t_new_col2im = time_ms(run_new_col2im, iters);
+
+		cout << fixed << setprecision(3) << setw(22) << left << s.name << right
+			<< "im2col " << t_old_im2col << " -> " << t_new_im2col
+			<< "  col2im " << t_old_col2im << " -> " << t_new_col2im
+			<< "  max diff " << scientific << setprecision(1)
+			<< std::max(max_abs_diff(old_cols, new_cols), max_abs_diff(old_im, new_im)) << endl;
+	}
+
+	return 0;
+}
\ No newline at end of file
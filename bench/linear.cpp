@@ -0,0 +1,95 @@
+// A forward and backward step of the 784-500-150-10 Linear stack (the "linear" model of main.cpp)
+// with the per-sample loops Linear ran before, one GEMV or rank-1 update per sample, against
+// the current layers, one GEMM per pass over the batch.
+#include "bench.h"
+
+// The previous Linear, without the layer plumbing.
+struct OldLinear
+{
+	MatXf W, dW, output, delta;
+	RowVecXf b, db;
+
+	OldLinear(const Linear& l, int batch) :
+		W(l.W), dW(MatXf::Zero(l.W.rows(), l.W.cols())), output(batch, l.W.rows()), delta(batch, l.W.rows()),
+		b(l.b), db(RowVecXf::Zero(l.b.size())) {}
+
+	void forward(const MatXf& prev_out)
+	{
+		for (int n = 0; n < output.rows(); n++) {
+			output.row(n).noalias() = W * prev_out.row(n).transpose();
+			output.row(n).noalias() += b;
+		}
+	}
+
+	void backward(const MatXf& prev_out, MatXf& prev_delta, bool is_first)
+	{
+		for (int n = 0; n < output.rows(); n++) {
+			dW.noalias() += delta.row(n).transpose() * prev_out.row(n);
+			db.noalias() += delta.row(n);
+		}
+		if (!is_first) {
+			for (int n = 0; n < output.rows(); n++) {
+				prev_delta.row(n).noalias() = W.transpose() * delta.row(n).transpose();
+			}
+		}
+	}
+};
+
+int main()
+{
+	vector<int> features = { 784, 500, 150, 10 };
+	int n_layers = (int)features.size() - 1;
+
+	cout << "forward + backward step of the 784-500-150-10 Linear stack, ms (old -> new)" << endl;
+	for (int batch : { 32, 128, 256, 512, 1024 }) {
+		int iters = std::max(3, 8192 / batch);
+		MatXf x = random_matrix(batch, features[0], 1);
+		MatXf dy = random_matrix(batch, features.back(), 2);
+		MapXf input(x.data(), x.rows(), x.cols());
+
+		vector<Linear> layers;
+		vector<vector<float>> mem;
+		vector<OldLinear> old_layers;
+		for (int i = 0; i < n_layers; i++) {
+			layers.emplace_back(features[i], features[i + 1], "lecun_uniform");
+		}
+		for (int i = 0; i < n_layers; i++) {
+			layers[i].is_first = i == 0;
+			layers[i].set_layer({ batch, features[i] });
+			mem.push_back(place_buffers(layers[i]));
+			old_layers.emplace_back(layers[i], batch);
+		}
+
+		auto old_step = [&]() {
+			for (int i = 0; i < n_layers; i++) {
+				old_layers[i].forward(i == 0 ? x : old_layers[i - 1].output);
+			}
+			old_layers.back().delta = dy;
+			for (int i = n_layers - 1; i >= 0; i--) {
+				MatXf& prev_delta = i == 0 ? x : old_layers[i - 1].delta;
+				old_layers[i].backward(i == 0 ? x : old_layers[i - 1].output, prev_delta, i == 0);
+			}
+		};
+		auto new_step = [&]() {
+			for (int i = 0; i < n_layers; i++) {
+				layers[i].forward(i == 0 ? input : layers[i - 1].output, true);
+			}
+			layers.back().delta = dy;
+			for (int i = n_layers - 1; i >= 0; i--) {
+				MapXf& prev_delta = i == 0 ? input : layers[i - 1].delta;
+				layers[i].backward(i == 0 ? input : layers[i - 1].output, prev_delta);
+			}
+		};
+
+		double t_old = time_ms(old_step, iters);
+		double t_new = time_ms(new_step, iters);
+		float diff = std::max(max_abs_diff(old_layers.back().output, layers.back().output),
+			max_abs_diff(old_layers[0].delta, layers[0].delta));
+
+		cout << "batch " << setw(4) << batch << fixed << setprecision(2)
+			<< "  " << setw(8) << t_old << " -> " << setw(7) << t_new
+			<< "  (" << t_old / t_new << "x)  max diff " << scientific << setprecision(1) << diff << endl;
+	}
+
+	return 0;
+}
\ No newline at end of file
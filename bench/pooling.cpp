@@ -0,0 +1,102 @@
+// The pooling configurations specialized at compile time against the loops that ran them
+// before, for a batch of 256 16-channel 28x28 planes (29x29 for 3x3 windows):
+// - MaxPool2dK 2x2/s2 and 3x3/s2 against their previous window loops, which branch on every
+//   comparison;
+// - AvgPool2dK 3x3/s2 against the generic AvgPool2d, which ran it before.
+#include "bench.h"
+
+// MaxPool2dK as it was before the branch-free selects.
+template<int K, int S>
+class OldMaxPool2dK : public MaxPool2d
+{
+public:
+	OldMaxPool2dK(const MaxPool2d& pool) : MaxPool2d(pool) {}
+
+	void forward(const MapXf& prev_out, bool is_training) override
+	{
+		std::fill(codes.begin(), codes.end(), 0);
+		for (int p = 0; p < batch * ch; p++) {
+			const float* im = prev_out.data() + ihw * p;
+			float* out = output.data() + ohw * p;
+			for (int i = 0; i < oh; i++) {
+				for (int j = 0; j < ow; j++) {
+					int first = iw * i * S + j * S;
+					float max = im[first];
+					int max_yx = 0;
+					unroll(std::make_integer_sequence<int, K * K>(), [&](auto yx) {
+						int pos = first + iw * (yx / K) + yx % K;
+						if (im[pos] > max) {
+							max = im[pos];
+							max_yx = yx;
+						}
+					});
+					out[ow * i + j] = max;
+					save_argmax(ohw * p + ow * i + j, ihw * p + first + iw * (max_yx / K) + max_yx % K, max_yx);
+				}
+			}
+		}
+	}
+};
+
+// Times forward and backward of two set layers of the same configuration on the same input
+// and prints them with the largest difference of their outputs and input gradients.
+void compare(const string& name, Layer& old_layer, Layer& new_layer, const vector<int>& shape, int iters)
+{
+	vector<float> old_mem = place_buffers(old_layer);
+	vector<float> new_mem = place_buffers(new_layer);
+	MatXf x = random_matrix(shape[0] * shape[1], shape[2] * shape[3], 1);
+	MatXf dy = random_matrix((int)new_layer.delta.rows(), (int)new_layer.delta.cols(), 2);
+	MatXf old_dx(x.rows(), x.cols()), new_dx(x.rows(), x.cols());
+	MapXf input(x.data(), x.rows(), x.cols());
+	MapXf old_prev_delta(old_dx.data(), x.rows(), x.cols());
+	MapXf new_prev_delta(new_dx.data(), x.rows(), x.cols());
+
+	double t_old_fwd = time_ms([&]() { old_layer.forward(input, true); }, iters);
+	double t_new_fwd = time_ms([&]() { new_layer.forward(input, true); }, iters);
+
+	old_layer.delta = dy;
+	new_layer.delta = dy;
+	auto old_bwd = [&]() { old_dx.setZero(); old_layer.backward(input, old_prev_delta); };
+	auto new_bwd = [&]() { new_dx.setZero(); new_layer.backward(input, new_prev_delta); };
+	double t_old_bwd = time_ms(old_bwd, iters);
+	double t_new_bwd = time_ms(new_bwd, iters);
+
+	MatXf old_y = old_layer.output, new_y = new_layer.output;
+	float diff = std::max(max_abs_diff(old_y, new_y), max_abs_diff(old_dx, new_dx));
+
+	cout << setw(18) << left << name << right << fixed << setprecision(2)
+		<< "fwd " << setw(6) << t_old_fwd << " -> " << setw(5) << t_new_fwd
+		<< "  bwd " << setw(6) << t_old_bwd << " -> " << setw(5) << t_new_bwd
+		<< "  max diff " << scientific << setprecision(1) << diff << endl;
+}
+
+int main()
+{
+	int batch = 256, ch = 16, iters = 20;
+	vector<int> even = { batch, ch, 28, 28 };
+	vector<int> odd = { batch, ch, 29, 29 };
+
+	cout << "pooling of " << batch << "x" << ch << " planes, ms (old -> new)" << endl;
+	{
+		MaxPool2d pool(2, 2);
+		pool.set_layer(even);
+		OldMaxPool2dK<2, 2> old_pool(pool);
+		unique_ptr<Layer> new_pool(pool.specialize());
+		compare("MaxPool2d 2x2/s2", old_pool, *new_pool, even, iters);
+	}
+	{
+		MaxPool2d pool(3, 2);
+		pool.set_layer(odd);
+		OldMaxPool2dK<3, 2> old_pool(pool);
+		unique_ptr<Layer> new_pool(pool.specialize());
+		compare("MaxPool2d 3x3/s2", old_pool, *new_pool, odd, iters);
+	}
+	{
+		AvgPool2d pool(3, 2);
+		pool.set_layer(odd);
+		unique_ptr<Layer> new_pool(pool.specialize());
+		compare("AvgPool2d 3x3/s2", pool, *new_pool, odd, iters);
+	}
+
+	return 0;
+}
\ No newline at end of file
@@ -1,8 +1,13 @@
 #pragma once
 #include "layer.h"
+#include "activation_kernels.h"
 
 namespace simple_nn
 {
+	// elements per thread below which an elementwise kernel is not split further; a multiple of 32,
+	// so chunks start on whole words of a ReLU compact mask
+	const int ACTIV_GRAIN = 4096;
+
 	class Activation : public Layer
 	{
 	protected:
@@ -23,30 +28,45 @@ namespace simple_nn
 				width = input_shape[3];
 				out_block_size = batch * channels * height * width;
 
-				output.resize(batch * channels, height * width);
-				delta.resize(batch * channels, height * width);
+				if (in_place) {
+					reshape(output, 0, 0);
+					reshape(delta, 0, 0);
+				}
+				else if (layout == Layout::NHWC) {
+					reshape(output, batch * height * width, channels);
+					reshape(delta, batch * height * width, channels);
+				}
+				else {
+					reshape(output, batch * channels, height * width);
+					reshape(delta, batch * channels, height * width);
+				}
 			}
 			else {
 				batch = input_shape[0];
 				height = input_shape[1];
 				out_block_size = batch * height;
 
-				output.resize(batch, height);
-				delta.resize(batch, height);
+				reshape(output, in_place ? 0 : batch, in_place ? 0 : height);
+				reshape(delta, in_place ? 0 : batch, in_place ? 0 : height);
 			}
 		}
 
-		void forward(const MatXf& prev_out, bool is_training) override { return; }
+		void forward(const MapXf& prev_out, bool is_training) override { return; }
 
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override { return; }
-
-		void zero_grad() override { delta.setZero(); }
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override { return; }
 
 		vector<int> output_shape() override
 		{
 			if (channels == 0) return { batch, height };
 			else return { batch, channels, height, width };
 		}
+	protected:
+		// Runs f(offset, size) over chunks of the out_block_size elements, split across the pool.
+		template<typename F>
+		void for_each_chunk(const F& f)
+		{
+			parallel_for(out_block_size, [&](int begin, int end, int t) { f(begin, end - begin); }, ACTIV_GRAIN);
+		}
 	};
 
 	class Tanh : public Activation
@@ -54,29 +74,29 @@ namespace simple_nn
 	public:
 		Tanh() : Activation() {}
 
-		void forward(const MatXf& prev_out, bool is_training) override
+		Layer* clone() const override { return new Tanh(*this); }
+
+		void forward(const MapXf& prev_out, bool is_training) override
 		{
 			assert(!is_last && "Tanh::forward(const vector<float>, bool): Hidden layer activation.");
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				output.data(),
-				[](const float& e) { return 2 / (1 + std::exp(-2.f * e)) - 1; }
-			);
-		}
-
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override
-		{
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				delta.data(), 
-				prev_delta.data(),
-				[](const float& e1, const float& e2) {
-					float tanh = 2 / (1 + std::exp(-2.f * e1)) - 1;
-					return e2 * (1 - tanh * tanh);
-				}
-			);
+			for_each_chunk([&](int i, int size) { tanh_forward(prev_out.data() + i, output.data() + i, size); });
+		}
+
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
+		{
+			for_each_chunk([&](int i, int size) { tanh_backward(output.data() + i, delta.data() + i, prev_delta.data() + i, size); });
+		}
+
+		bool supports_in_place() const override { return true; }
+
+		void forward_in_place(MapXf& x) override
+		{
+			for_each_chunk([&](int i, int size) { tanh_forward(x.data() + i, x.data() + i, size); });
+		}
+
+		void backward_in_place(const MapXf& y, MapXf& d) override
+		{
+			for_each_chunk([&](int i, int size) { tanh_backward(y.data() + i, d.data() + i, d.data() + i, size); });
 		}
 	};
 
@@ -85,44 +105,39 @@ namespace simple_nn
 	public:
 		Sigmoid() : Activation() {}
 
-		void forward(const MatXf& prev_out, bool is_training) override
+		Layer* clone() const override { return new Sigmoid(*this); }
+
+		void forward(const MapXf& prev_out, bool is_training) override
 		{
 			assert(is_last && "Sigmoid::forward(const vector<float>, bool): Output layer activation.");
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				output.data(),
-				[](const float& e) { return 1 / (1 + std::exp(-e)); }
-			);
-		}
-
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override
-		{
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				delta.data(), 
-				prev_delta.data(),
-				[](const float& e1, const float& e2) {
-					float sigmoid = 1 / (1 + std::exp(-e1));
-					return e2 * (1 - sigmoid * sigmoid);
-				}
-			);
+			for_each_chunk([&](int i, int size) { sigmoid_forward(prev_out.data() + i, output.data() + i, size); });
 		}
-	};
 
-	float sum_exp(const float* p, int size, float max)
-	{
-		float out = std::accumulate(p, p + size, 0.f,
-			[&](const float& sum, const float& elem) { return sum + std::exp(elem - max); });
-		return out;
-	}
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
+		{
+			for_each_chunk([&](int i, int size) { sigmoid_backward(output.data() + i, delta.data() + i, prev_delta.data() + i, size); });
+		}
+
+		bool supports_in_place() const override { return true; }
+
+		void forward_in_place(MapXf& x) override
+		{
+			for_each_chunk([&](int i, int size) { sigmoid_forward(x.data() + i, x.data() + i, size); });
+		}
+
+		void backward_in_place(const MapXf& y, MapXf& d) override
+		{
+			for_each_chunk([&](int i, int size) { sigmoid_backward(y.data() + i, d.data() + i, d.data() + i, size); });
+		}
+	};
 
 	class Softmax : public Activation
 	{
 	public:
 		Softmax() : Activation() {}
 
+		Layer* clone() const override { return new Softmax(*this); }
+
 		void set_layer(const vector<int>& input_shape) override
 		{
 			assert(input_shape.size() == 2 && "Softmax::set_layer(const vector<int>&): Does not support 2d activation.");
@@ -130,26 +145,18 @@ namespace simple_nn
 			batch = input_shape[0];
 			height = input_shape[1];
 			out_block_size = batch * height;
-			output.resize(batch, height);
-			delta.resize(batch, height);
-		}
-
-		void forward(const MatXf& prev_out, bool is_training) override
-		{
-			output.setZero();
-			for (int n = 0; n < batch; n++) {
-				int offset = height * n;
-				const float* begin = prev_out.data() + offset;
-				float max = *std::max_element(begin, begin + height);
-				float sum = sum_exp(begin, height, max);
-				std::transform(begin, begin + height, output.data() + offset,
-					[&](const float& e) {
-						return std::exp(e - max) / sum;
-					});
-			}
+			reshape(output, batch, height);
+			reshape(delta, batch, height);
+		}
+
+		void forward(const MapXf& prev_out, bool is_training) override
+		{
+			parallel_for(batch, [&](int n0, int n1, int t) {
+				softmax_forward(prev_out.data() + (size_t)height * n0, output.data() + (size_t)height * n0, n1 - n0, height);
+			});
 		}
 
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
 		{
 			std::copy(delta.data(), delta.data() + out_block_size, prev_delta.data());
 		}
@@ -157,31 +164,57 @@ namespace simple_nn
 
 	class ReLU : public Activation
 	{
+	private:
+		bool compact_mask;
+		vector<uint32_t> mask;	// one bit per element in compact mask mode
 	public:
-		ReLU() : Activation() {}
+		ReLU() : Activation(), compact_mask(false) {}
+
+		Layer* clone() const override { return new ReLU(*this); }
 
-		void forward(const MatXf& prev_out, bool is_training) override
+		// Keeps the sign of the output as a bit mask for backward instead of reading the output.
+		void set_compact_mask(bool enable) { compact_mask = enable; }
+
+		void set_layer(const vector<int>& input_shape) override
 		{
-			output.setZero();
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				output.data(),
-				[](const float& e) { return std::max(0.f, e); }
-			);
+			Activation::set_layer(input_shape);
+			// without backward there is no sign to keep
+			if (inference_only) compact_mask = false;
+			mask.resize(compact_mask ? (out_block_size + 31) / 32 : 0);
 		}
 
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override
+		void forward(const MapXf& prev_out, bool is_training) override
 		{
-			std::transform(
-				prev_out.data(), 
-				prev_out.data() + out_block_size, 
-				delta.data(), 
-				prev_delta.data(),
-				[](const float& e1, const float& e2) {
-					return (e1 <= 0) ? 0 : e2;
-				}
-			);
+			for_each_chunk([&](int i, int size) {
+				if (compact_mask) relu_forward_mask(prev_out.data() + i, output.data() + i, mask.data() + i / 32, size);
+				else relu_forward(prev_out.data() + i, output.data() + i, size);
+			});
+		}
+
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
+		{
+			for_each_chunk([&](int i, int size) {
+				if (compact_mask) relu_mask_backward(mask.data() + i / 32, delta.data() + i, prev_delta.data() + i, size);
+				else relu_backward(output.data() + i, delta.data() + i, prev_delta.data() + i, size);
+			});
+		}
+
+		bool supports_in_place() const override { return true; }
+
+		void forward_in_place(MapXf& x) override
+		{
+			for_each_chunk([&](int i, int size) {
+				if (compact_mask) relu_forward_mask(x.data() + i, x.data() + i, mask.data() + i / 32, size);
+				else relu_forward(x.data() + i, x.data() + i, size);
+			});
+		}
+
+		void backward_in_place(const MapXf& y, MapXf& d) override
+		{
+			for_each_chunk([&](int i, int size) {
+				if (compact_mask) relu_mask_backward(mask.data() + i / 32, d.data() + i, d.data() + i, size);
+				else relu_backward(y.data() + i, d.data() + i, d.data() + i, size);
+			});
 		}
 	};
 }
\ No newline at end of file
@@ -5,7 +5,7 @@ namespace simple_nn
 {
 	class AvgPool2d : public Layer
 	{
-	private:
+	protected:
 		int batch;
 		int ch;
 		int ih;
@@ -21,10 +21,14 @@ namespace simple_nn
 	public:
 		AvgPool2d(int kernel_size, int stride);
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
-		void zero_grad() override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		vector<int> output_shape() override;
+		Layer* clone() const override;
+		Layer* specialize() override;
+	private:
+		void forward_nhwc(const MapXf& prev_out);
+		void backward_nhwc(MapXf& prev_delta);
 	};
 
 	AvgPool2d::AvgPool2d(int kernel_size, int stride) :
@@ -52,74 +56,212 @@ namespace simple_nn
 		ow = calc_outsize(iw, kw, stride, 0);
 		ohw = oh * ow;
 
-		output.resize(batch * ch, ohw);
-		delta.resize(batch * ch, ohw);
+		if (layout == Layout::NHWC) {
+			reshape(output, batch * ohw, ch);
+			reshape(delta, batch * ohw, ch);
+		}
+		else {
+			reshape(output, batch * ch, ohw);
+			reshape(delta, batch * ch, ohw);
+		}
 		// im_col.resize(kh * kw, ohw);
 	}
 
-	void AvgPool2d::forward(const MatXf& prev_out, bool is_training)
+	void AvgPool2d::forward(const MapXf& prev_out, bool is_training)
 	{
+		if (layout == Layout::NHWC) {
+			forward_nhwc(prev_out);
+			return;
+		}
+
 		output.setZero();
 		float* out = output.data();
 		const float* pout = prev_out.data();
 		float denominator = (float)(kh * kw);
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
-				for (int i = 0; i < oh; i++) {
-					for (int j = 0; j < ow; j++) {
-						int out_idx = j + ow * (i + oh * (c + ch * n));
-						for (int y = 0; y < kh; y++) {
-							for (int x = 0; x < kw; x++) {
-								int ii = i * stride + y;
-								int jj = j * stride + x;
-								int in_idx = jj + iw * (ii + ih * (c + ch * n));
-								if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
-									out[out_idx] += pout[in_idx];
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
+				for (int c = 0; c < ch; c++) {
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							int out_idx = j + ow * (i + oh * (c + ch * n));
+							for (int y = 0; y < kh; y++) {
+								for (int x = 0; x < kw; x++) {
+									int ii = i * stride + y;
+									int jj = j * stride + x;
+									int in_idx = jj + iw * (ii + ih * (c + ch * n));
+									if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
+										out[out_idx] += pout[in_idx];
+									}
 								}
 							}
+							out[out_idx] /= denominator;
 						}
-						out[out_idx] /= denominator;
 					}
 				}
 			}
-		}
+		});
 
 		/*for (int n = 0; n < batch; n++) {
 			for (int c = 0; c < channels; c++) {
 				const float* im = prev_out.data() + ihw * (c + channels * n);
-				im2col(im, 1, ih, iw, kh, stride, 0, im_col.data());
+				im2col(im, 1, ih, iw, kh, stride, 0, 1, im_col.data());
 				output.row(c + channels * n) = im_col.colwise().mean();
 			}
 		}*/
 	}
 
-	void AvgPool2d::backward(const MatXf& prev_out, MatXf& prev_delta)
+	void AvgPool2d::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
+		if (layout == Layout::NHWC) {
+			backward_nhwc(prev_delta);
+			return;
+		}
+
 		float* pd = prev_delta.data();
 		const float* d = delta.data();
 		float denominator = (float)(kh * kw);
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
+				for (int c = 0; c < ch; c++) {
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							int cur_idx = j + ow * (i + oh * (c + ch * n));
+							for (int y = 0; y < kh; y++) {
+								for (int x = 0; x < kw; x++) {
+									int ii = y + stride * i;
+									int jj = x + stride * j;
+									int prev_idx = jj + iw * (ii + ih * (c + ch * n));
+									if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
+										pd[prev_idx] += d[cur_idx] / denominator;
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+		});
+	}
+
+	void AvgPool2d::forward_nhwc(const MapXf& prev_out)
+	{
+		output.setZero();
+		float denominator = (float)(kh * kw);
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
 				for (int i = 0; i < oh; i++) {
 					for (int j = 0; j < ow; j++) {
-						int cur_idx = j + ow * (i + oh * (c + ch * n));
+						auto out = output.row(j + ow * (i + oh * n));
+						for (int y = 0; y < kh; y++) {
+							for (int x = 0; x < kw; x++) {
+								int ii = i * stride + y;
+								int jj = j * stride + x;
+								if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
+									out += prev_out.row(jj + iw * (ii + ih * n));
+								}
+							}
+						}
+						out /= denominator;
+					}
+				}
+			}
+		});
+	}
+
+	void AvgPool2d::backward_nhwc(MapXf& prev_delta)
+	{
+		float denominator = (float)(kh * kw);
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
+				for (int i = 0; i < oh; i++) {
+					for (int j = 0; j < ow; j++) {
+						auto d = delta.row(j + ow * (i + oh * n));
 						for (int y = 0; y < kh; y++) {
 							for (int x = 0; x < kw; x++) {
 								int ii = y + stride * i;
 								int jj = x + stride * j;
-								int prev_idx = jj + iw * (ii + ih * (c + ch * n));
 								if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
-									pd[prev_idx] = d[cur_idx] / denominator;
+									prev_delta.row(jj + iw * (ii + ih * n)) += d / denominator;
 								}
 							}
 						}
 					}
 				}
 			}
-		}
+		});
 	}
 
-	void AvgPool2d::zero_grad() { delta.setZero(); }
-
 	vector<int> AvgPool2d::output_shape() { return { batch, ch, oh, ow }; }
+
+	Layer* AvgPool2d::clone() const { return new AvgPool2d(*this); }
+
+	// AvgPool2d with the window and stride fixed at compile time. Planes are split across threads.
+	template<int K, int S>
+	class AvgPool2dK : public AvgPool2d
+	{
+	public:
+		AvgPool2dK() : AvgPool2d(K, S) {}
+		AvgPool2dK(const AvgPool2d& pool) : AvgPool2d(pool) {}
+		Layer* specialize() override { return nullptr; }
+
+		void forward(const MapXf& prev_out, bool is_training) override
+		{
+			if (layout != Layout::NCHW) {
+				AvgPool2d::forward(prev_out, is_training);
+				return;
+			}
+
+			parallel_for(batch * ch, [&](int p0, int p1, int t) {
+				for (int p = p0; p < p1; p++) {
+					const float* im = prev_out.data() + ihw * p;
+					float* out = output.data() + ohw * p;
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							const float* first = im + iw * i * S + j * S;
+							float sum = 0.f;
+							unroll(std::make_integer_sequence<int, K * K>(), [&](auto yx) {
+								sum += first[iw * (yx / K) + yx % K];
+							});
+							out[ow * i + j] = sum / (K * K);
+						}
+					}
+				}
+			});
+		}
+
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
+		{
+			if (layout != Layout::NCHW) {
+				AvgPool2d::backward(prev_out, prev_delta);
+				return;
+			}
+
+			parallel_for(batch * ch, [&](int p0, int p1, int t) {
+				for (int p = p0; p < p1; p++) {
+					float* pd = prev_delta.data() + ihw * p;
+					const float* d = delta.data() + ohw * p;
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							float* first = pd + iw * i * S + j * S;
+							float g = d[ow * i + j] / (K * K);
+							// windows that overlap (S < K) share inputs, whose gradients add up
+							unroll(std::make_integer_sequence<int, K * K>(), [&](auto yx) {
+								if (S < K) first[iw * (yx / K) + yx % K] += g;
+								else first[iw * (yx / K) + yx % K] = g;
+							});
+						}
+					}
+				}
+			});
+		}
+	};
+
+	Layer* AvgPool2d::specialize()
+	{
+		if (layout != Layout::NCHW) return nullptr;
+
+		if (kh == 2 && stride == 2) return new AvgPool2dK<2, 2>(*this);
+		if (kh == 3 && stride == 2) return new AvgPool2dK<3, 2>(*this);
+		return nullptr;
+	}
 }
\ No newline at end of file
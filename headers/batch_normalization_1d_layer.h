@@ -1,5 +1,6 @@
 #pragma once
 #include "layer.h"
+#include "replica_group.h"
 
 namespace simple_nn
 {
@@ -10,8 +11,10 @@ namespace simple_nn
 		int n_feat;
 		float eps;
 		float momentum;
-		MatXf xhat;
-		MatXf dxhat;
+		bool low_memory;
+		ReplicaGroup* group;
+		int rank;
+		MapXf xhat;
 		RowVecXf mu;
 		RowVecXf var;
 		RowVecXf dgamma;
@@ -24,16 +27,22 @@ namespace simple_nn
 		RowVecXf gamma;
 		RowVecXf beta;
 		BatchNorm1d(float eps = 0.00001f, float momentum = 0.9f);
+		void set_low_memory(bool enable);
+		void set_group(ReplicaGroup* group, int rank);
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		void update_weight(float lr, float decay) override;
 		void zero_grad() override;
 		vector<int> output_shape() override;
+		void fold_into(MatXf& weight, float* bias) const;
+		Layer* clone() const override;
+		vector<Param> params() override;
+		vector<Buffer> buffers() override;
 	private:
-		void calc_batch_mu(const MatXf& prev_out);
-		void calc_batch_var(const MatXf& prev_out);
-		void normalize_and_shift(const MatXf& prev_out, bool is_training);
+		int global_batch() const;
+		void calc_batch_stats(const MapXf& prev_out);
+		void normalize_and_shift(const MapXf& prev_out, bool is_training);
 	};
 
 	BatchNorm1d::BatchNorm1d(float eps, float momentum) :
@@ -41,7 +50,21 @@ namespace simple_nn
 		batch(0),
 		n_feat(0),
 		eps(eps),
-		momentum(momentum) {}
+		momentum(momentum),
+		low_memory(false),
+		group(nullptr),
+		rank(0),
+		xhat(nullptr, 0, 0) {}
+
+	// Low-memory mode recomputes xhat from the input in backward instead of storing it (see BatchNorm2d).
+	void BatchNorm1d::set_low_memory(bool enable) { low_memory = enable; }
+
+	// Shares the statistics and the sums of backward with the other replicas of group (see BatchNorm2d).
+	void BatchNorm1d::set_group(ReplicaGroup* group, int rank)
+	{
+		this->group = group;
+		this->rank = rank;
+	}
 
 	void BatchNorm1d::set_layer(const vector<int>& input_shape)
 	{
@@ -50,20 +73,19 @@ namespace simple_nn
 		batch = input_shape[0];
 		n_feat = input_shape[1];
 
-		output.resize(batch, n_feat);
-		delta.resize(batch, n_feat);
-		xhat.resize(batch, n_feat);
-		dxhat.resize(batch, n_feat);
+		reshape(output, batch, n_feat);
+		reshape(delta, batch, n_feat);
+		reshape(xhat, low_memory || inference_only ? 0 : batch, n_feat);
 		move_mu.resize(n_feat);
 		move_var.resize(n_feat);
 		mu.resize(n_feat);
 		var.resize(n_feat);
 		gamma.resize(n_feat);
-		dgamma.resize(n_feat);
+		dgamma.resize(inference_only ? 0 : n_feat);
 		beta.resize(n_feat);
-		dbeta.resize(n_feat);
-		sum1.resize(n_feat);
-		sum2.resize(n_feat);
+		dbeta.resize(inference_only ? 0 : n_feat);
+		sum1.resize(inference_only ? 0 : n_feat);
+		sum2.resize(inference_only ? 0 : n_feat);
 
 		move_mu.setZero();
 		move_var.setZero();
@@ -71,11 +93,10 @@ namespace simple_nn
 		beta.setZero();
 	}
 
-	void BatchNorm1d::forward(const MatXf& prev_out, bool is_training)
+	void BatchNorm1d::forward(const MapXf& prev_out, bool is_training)
 	{
 		if (is_training) {
-			calc_batch_mu(prev_out);
-			calc_batch_var(prev_out);
+			calc_batch_stats(prev_out);
 			normalize_and_shift(prev_out, is_training);
 			// update moving mu and var
 			move_mu = move_mu * momentum + mu * (1 - momentum);
@@ -86,67 +107,94 @@ namespace simple_nn
 		}
 	}
 
-	void BatchNorm1d::calc_batch_mu(const MatXf& prev_out)
-	{
-		mu = prev_out.colwise().mean();
-	}
-
-	void BatchNorm1d::calc_batch_var(const MatXf& prev_out)
+	// Mean and variance of every feature from one sweep over the batch (sums of (x - k) and
+	// (x - k)^2 with k the first sample), vectorized across the features of each row.
+	// Features are split across threads for the reductions, rows for the elementwise passes.
+	void BatchNorm1d::calc_batch_stats(const MapXf& prev_out)
 	{
-		var.setZero();
-		for (int i = 0; i < batch; i++) {
-			for (int j = 0; j < n_feat; j++) {
-				float diff = prev_out(i, j) - mu[j];
-				var[j] += diff * diff / batch; // (batch - 1)?
+		RowVecXf k = prev_out.row(0);
+		if (group != nullptr) group->broadcast(rank, k.data(), n_feat);
+		RowVecXf s1 = RowVecXf::Zero(n_feat);
+		RowVecXf s2 = RowVecXf::Zero(n_feat);
+		parallel_for(n_feat, [&](int f0, int f1, int t) {
+			int nf = f1 - f0;
+			for (int i = 0; i < batch; i++) {
+				s1.segment(f0, nf) += prev_out.row(i).segment(f0, nf) - k.segment(f0, nf);
+				s2.segment(f0, nf) += (prev_out.row(i).segment(f0, nf) - k.segment(f0, nf)).cwiseAbs2();
 			}
+		}, 8);
+		if (group != nullptr) {
+			group->all_reduce(rank, s1.data(), n_feat);
+			group->all_reduce(rank, s2.data(), n_feat);
 		}
+		int m = global_batch();
+		RowVecXf mean = s1 / m;
+		mu = k + mean;
+		var = (s2 / m - mean.cwiseAbs2()).cwiseMax(0.f);
 	}
 
-	void BatchNorm1d::normalize_and_shift(const MatXf& prev_out, bool is_training)
+	// xhat is only kept for backward (unless in low-memory mode); otherwise y = (x - mean) * scale + beta.
+	void BatchNorm1d::normalize_and_shift(const MapXf& prev_out, bool is_training)
 	{
-		const float* M = mu.data();
-		const float* V = var.data();
-
-		if (!is_training) {
-			M = move_mu.data();
-			V = move_var.data();
-		}
-
-		for (int i = 0; i < batch; i++) {
-			for (int j = 0; j < n_feat; j++) {
-				xhat(i, j) = (prev_out(i, j) - M[j]) / std::sqrt(V[j] + eps);
-				output(i, j) = gamma[j] * xhat(i, j) + beta[j];
+		const RowVecXf& M = is_training ? mu : move_mu;
+		const RowVecXf& V = is_training ? var : move_var;
+		RowVecXf inv_std = (V.array() + eps).rsqrt();
+
+		RowVecXf scale = gamma.cwiseProduct(inv_std);
+		parallel_for(batch, [&](int i0, int i1, int t) {
+			for (int i = i0; i < i1; i++) {
+				if (is_training && !low_memory) {
+					xhat.row(i) = (prev_out.row(i) - M).cwiseProduct(inv_std);
+					output.row(i) = xhat.row(i).cwiseProduct(gamma) + beta;
+				}
+				else {
+					output.row(i) = (prev_out.row(i) - M).cwiseProduct(scale) + beta;
+				}
 			}
-		}
+		});
 	}
 
-	void BatchNorm1d::backward(const MatXf& prev_out, MatXf& prev_delta)
+	// Two passes over the batch: the first reduces delta and delta * xhat (dbeta, dgamma and, scaled
+	// by gamma, Sum(dxhat) and Sum(dxhat * xhat)), the second writes
+	// dx = (m * gamma * delta - sum1 - xhat * sum2) / (m * sqrt(var + eps)).
+	// xhat is read as (src - offset) * scale: the stored xhat (0, 1) or, in low-memory mode, the
+	// input (mu, 1 / sqrt(var + eps)).
+	void BatchNorm1d::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
-		// calc dxhat
-		for (int i = 0; i < batch; i++) {
-			for (int j = 0; j < n_feat; j++) {
-				dxhat(i, j) = delta(i, j) * gamma[j];
-			}
-		}
-
-		// calc Sum(dxhat), Sum(dxhat * xhat)
-		for (int i = 0; i < batch; i++) {
-			for (int j = 0; j < n_feat; j++) {
-				sum1[j] += dxhat(i, j);
-				sum2[j] += dxhat(i, j) * xhat(i, j);
+		const MapXf& src = low_memory ? prev_out : xhat;
+		RowVecXf inv_std = (var.array() + eps).rsqrt();
+		RowVecXf offset = low_memory ? mu : RowVecXf::Zero(n_feat);
+		RowVecXf scale = low_memory ? inv_std : RowVecXf::Ones(n_feat);
+
+		RowVecXf db = RowVecXf::Zero(n_feat);
+		RowVecXf dg = RowVecXf::Zero(n_feat);
+		parallel_for(n_feat, [&](int f0, int f1, int t) {
+			int nf = f1 - f0;
+			for (int i = 0; i < batch; i++) {
+				db.segment(f0, nf) += delta.row(i).segment(f0, nf);
+				dg.segment(f0, nf) += delta.row(i).segment(f0, nf).cwiseProduct(src.row(i).segment(f0, nf) - offset.segment(f0, nf));
 			}
+		}, 8);
+		dg = dg.cwiseProduct(scale);
+		dbeta += db;
+		dgamma += dg;
+		if (group != nullptr) {
+			group->all_reduce(rank, db.data(), n_feat);
+			group->all_reduce(rank, dg.data(), n_feat);
 		}
-
-		// calc dx, dgamma, dbeta
-		float m = (float)batch;
-		for (int i = 0; i < batch; i++) {
-			for (int j = 0; j < n_feat; j++) {
-				prev_delta(i, j) = (m * dxhat(i, j)) - sum1[j] - (xhat(i, j) * sum2[j]);
-				prev_delta(i, j) /= m * std::sqrt(var[j] + eps);
-				dgamma[j] += xhat(i, j) * delta(i, j);
-				dbeta[j] += delta(i, j);
+		sum1 += gamma.cwiseProduct(db);
+		sum2 += gamma.cwiseProduct(dg);
+
+		float m = (float)global_batch();
+		RowVecXf k = inv_std / m;
+		RowVecXf a = k.cwiseProduct(gamma) * m;
+		RowVecXf s1 = k.cwiseProduct(sum1);
+		RowVecXf s2 = k.cwiseProduct(sum2).cwiseProduct(scale);
+		parallel_for(batch, [&](int i0, int i1, int t) {
+			for (int i = i0; i < i1; i++) {
+				prev_delta.row(i) = delta.row(i).cwiseProduct(a) - s1 - (src.row(i) - offset).cwiseProduct(s2);
 			}
-		}
+		});
 	}
 
 	void BatchNorm1d::update_weight(float lr, float decay)
@@ -163,8 +211,6 @@ namespace simple_nn
 
 	void BatchNorm1d::zero_grad()
 	{
-		delta.setZero();
-		dxhat.setZero();
 		dgamma.setZero();
 		dbeta.setZero();
 		sum1.setZero();
@@ -172,4 +218,31 @@ namespace simple_nn
 	}
 
 	vector<int> BatchNorm1d::output_shape() { return { batch, n_feat }; }
+
+	Layer* BatchNorm1d::clone() const { return new BatchNorm1d(*this); }
+
+	vector<Param> BatchNorm1d::params()
+	{
+		return {
+			{ move_mu.data(), nullptr, n_feat },
+			{ move_var.data(), nullptr, n_feat },
+			{ gamma.data(), dgamma.data(), n_feat },
+			{ beta.data(), dbeta.data(), n_feat }
+		};
+	}
+
+	vector<Buffer> BatchNorm1d::buffers() { return { make_buffer(xhat, Lifetime::STEP) }; }
+
+	int BatchNorm1d::global_batch() const { return group == nullptr ? batch : batch * group->size(); }
+
+	// Folds the inference transform y = gamma * (x - move_mu) / sqrt(move_var + eps) + beta into the
+	// layer before it: row i of weight (the weights of output feature i) and bias[i].
+	void BatchNorm1d::fold_into(MatXf& weight, float* bias) const
+	{
+		for (int i = 0; i < n_feat; i++) {
+			float scale = gamma[i] / std::sqrt(move_var[i] + eps);
+			weight.row(i) *= scale;
+			bias[i] = (bias[i] - move_mu[i]) * scale + beta[i];
+		}
+	}
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "layer.h"
+#include "replica_group.h"
 
 namespace simple_nn
 {
@@ -13,6 +14,9 @@ namespace simple_nn
 		int hw;
 		float eps;
 		float momentum;
+		bool low_memory;
+		ReplicaGroup* group;
+		int rank;
 		VecXf mu;
 		VecXf var;
 		VecXf dgamma;
@@ -20,23 +24,30 @@ namespace simple_nn
 		VecXf sum1;
 		VecXf sum2;
 	public:
-		MatXf xhat;
-		MatXf dxhat;
+		MapXf xhat;
 		VecXf move_mu;
 		VecXf move_var;
 		VecXf gamma;
 		VecXf beta;
 		BatchNorm2d(float eps = 0.00001f, float momentum = 0.9f);
+		void set_low_memory(bool enable);
+		void set_group(ReplicaGroup* group, int rank);
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		void update_weight(float lr, float decay) override;
 		void zero_grad() override;
 		vector<int> output_shape() override;
+		void fold_into(MatXf& weight, float* bias) const;
+		Layer* clone() const override;
+		vector<Param> params() override;
+		vector<Buffer> buffers() override;
 	private:
-		void calc_batch_mu(const MatXf& prev_out);
-		void calc_batch_var(const MatXf& prev_out);
-		void normalize_and_shift(const MatXf& prev_out, bool is_training);
+		int global_batch() const;
+		void calc_batch_stats(const MapXf& prev_out);
+		void normalize_and_shift(const MapXf& prev_out, bool is_training);
+		void forward_nhwc(const MapXf& prev_out, bool is_training);
+		void backward_nhwc(const MapXf& prev_out, MapXf& prev_delta);
 	};
 
 	BatchNorm2d::BatchNorm2d(float eps, float momentum) :
@@ -47,7 +58,24 @@ namespace simple_nn
 		w(0),
 		hw(0),
 		eps(eps),
-		momentum(momentum) {}
+		momentum(momentum),
+		low_memory(false),
+		group(nullptr),
+		rank(0),
+		xhat(nullptr, 0, 0) {}
+
+	// Low-memory mode keeps only the per-channel batch mean and variance: xhat is recomputed from
+	// the input in backward, so the layer holds output and delta but no third activation-sized buffer.
+	void BatchNorm2d::set_low_memory(bool enable) { low_memory = enable; }
+
+	// In a data-parallel model each replica sees a shard of the batch. With a group, the statistics
+	// and the sums of backward are added up over the replicas, so every shard is normalized as part
+	// of the whole batch; dgamma and dbeta stay per replica and are reduced with the other gradients.
+	void BatchNorm2d::set_group(ReplicaGroup* group, int rank)
+	{
+		this->group = group;
+		this->rank = rank;
+	}
 
 	void BatchNorm2d::set_layer(const vector<int>& input_shape)
 	{
@@ -59,20 +87,26 @@ namespace simple_nn
 		w = input_shape[3];
 		hw = h * w;
 
-		output.resize(batch * ch, hw);
-		delta.resize(batch * ch, hw);
-		xhat.resize(batch * ch, hw);
-		dxhat.resize(batch * ch, hw);
+		if (layout == Layout::NHWC) {
+			reshape(output, batch * hw, ch);
+			reshape(delta, batch * hw, ch);
+			reshape(xhat, low_memory || inference_only ? 0 : batch * hw, ch);
+		}
+		else {
+			reshape(output, batch * ch, hw);
+			reshape(delta, batch * ch, hw);
+			reshape(xhat, low_memory || inference_only ? 0 : batch * ch, hw);
+		}
 		move_mu.resize(ch);
 		move_var.resize(ch);
 		mu.resize(ch);
 		var.resize(ch);
 		gamma.resize(ch);
-		dgamma.resize(ch);
+		dgamma.resize(inference_only ? 0 : ch);
 		beta.resize(ch);
-		dbeta.resize(ch);
-		sum1.resize(ch);
-		sum2.resize(ch);
+		dbeta.resize(inference_only ? 0 : ch);
+		sum1.resize(inference_only ? 0 : ch);
+		sum2.resize(inference_only ? 0 : ch);
 
 		move_mu.setZero();
 		move_var.setZero();
@@ -80,11 +114,13 @@ namespace simple_nn
 		beta.setZero();
 	}
 
-	void BatchNorm2d::forward(const MatXf& prev_out, bool is_training)
+	void BatchNorm2d::forward(const MapXf& prev_out, bool is_training)
 	{
-		if (is_training) {
-			calc_batch_mu(prev_out);
-			calc_batch_var(prev_out);
+		if (layout == Layout::NHWC) {
+			forward_nhwc(prev_out, is_training);
+		}
+		else if (is_training) {
+			calc_batch_stats(prev_out);
 			normalize_and_shift(prev_out, is_training);
 			// update moving mu and var
 			move_mu = move_mu * momentum + mu * (1 - momentum);
@@ -95,34 +131,41 @@ namespace simple_nn
 		}
 	}
 
-	void BatchNorm2d::calc_batch_mu(const MatXf& prev_out)
+	// Mean and variance of each channel from one sweep over its rows: the sums of (x - k) and
+	// (x - k)^2, with k the channel's first value so the variance does not cancel when the mean is
+	// large. Rows are reduced in float and accumulated across the batch in double.
+	// Channels are split across threads, here and in the other passes.
+	void BatchNorm2d::calc_batch_stats(const MapXf& prev_out)
 	{
-		mu.setZero();
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
-				mu[c] += prev_out.row(c + ch * n).mean() / batch;
-			}
-		}
-	}
+		VecXf k = Map<const VecXf, 0, InnerStride<>>(prev_out.data(), ch, InnerStride<>(hw));
+		if (group != nullptr) group->broadcast(rank, k.data(), ch);
 
-	void BatchNorm2d::calc_batch_var(const MatXf& prev_out)
-	{
-		var.setZero();
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
-				int i = c + ch * n;
-				float m = mu[c];
-				float v = 0.f;
-				for (int j = 0; j < hw; j++) {
-					float diff = prev_out(i, j) - m;
-					v += diff * diff;
+		VectorXd s(2 * ch);	// sums of (x - k), then of (x - k)^2
+		parallel_for(ch, [&](int c0, int c1, int t) {
+			for (int c = c0; c < c1; c++) {
+				double s1 = 0.0;
+				double s2 = 0.0;
+				for (int n = 0; n < batch; n++) {
+					auto x = prev_out.row(c + ch * n).array() - k[c];
+					s1 += x.sum();
+					s2 += x.square().sum();
 				}
-				var[c] += v / hw / batch;
+				s[c] = s1;
+				s[ch + c] = s2;
 			}
+		});
+		if (group != nullptr) group->all_reduce(rank, s.data(), 2 * ch);
+
+		double m = (double)global_batch() * hw;
+		for (int c = 0; c < ch; c++) {
+			double mean = s[c] / m;
+			mu[c] = (float)(k[c] + mean);
+			var[c] = (float)std::max(s[ch + c] / m - mean * mean, 0.0);
 		}
 	}
 
-	void BatchNorm2d::normalize_and_shift(const MatXf& prev_out, bool is_training)
+	// xhat is only kept for backward (unless in low-memory mode); otherwise y = (x - mean) * scale + beta.
+	void BatchNorm2d::normalize_and_shift(const MapXf& prev_out, bool is_training)
 	{
 		const float* M = mu.data();
 		const float* V = var.data();
@@ -132,69 +175,233 @@ namespace simple_nn
 			V = move_var.data();
 		}
 
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
-				int i = c + ch * n;
+		parallel_for(ch, [&](int c0, int c1, int t) {
+			for (int c = c0; c < c1; c++) {
 				float m = M[c];
-				float s = std::sqrt(V[c] + eps);
+				float inv_std = 1.f / std::sqrt(V[c] + eps);
 				float g = gamma[c];
 				float b = beta[c];
-				for (int j = 0; j < hw; j++) {
-					xhat(i, j) = (prev_out(i, j) - m) / s;
-					output(i, j) = g * xhat(i, j) + b;
+				for (int n = 0; n < batch; n++) {
+					int i = c + ch * n;
+					if (is_training && !low_memory) {
+						xhat.row(i) = (prev_out.row(i).array() - m) * inv_std;
+						output.row(i) = xhat.row(i).array() * g + b;
+					}
+					else {
+						output.row(i) = (prev_out.row(i).array() - m) * (g * inv_std) + b;
+					}
 				}
 			}
-		}
+		});
 	}
 
-	void BatchNorm2d::backward(const MatXf& prev_out, MatXf& prev_delta)
+	// Two passes per channel: the first reduces delta and delta * xhat (dbeta, dgamma and, scaled by
+	// gamma, Sum(dxhat) and Sum(dxhat * xhat)), the second writes
+	// dx = (m * gamma * delta - sum1 - xhat * sum2) / (m * sqrt(var + eps)).
+	// xhat is read as (src - offset) * scale: the stored xhat (0, 1) or, in low-memory mode, the
+	// input (mu, 1 / sqrt(var + eps)).
+	void BatchNorm2d::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
-		// calc dxhat
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
+		if (layout == Layout::NHWC) {
+			backward_nhwc(prev_out, prev_delta);
+			return;
+		}
+
+		const MapXf& src = low_memory ? prev_out : xhat;
+		float m = (float)global_batch();
+		VectorXd s(2 * ch);	// sums of delta, then of delta * xhat
+
+		auto reduce = [&](int c) {
+			float offset = low_memory ? mu[c] : 0.f;
+			float scale = low_memory ? 1.f / std::sqrt(var[c] + eps) : 1.f;
+			double db = 0.0;
+			double dg = 0.0;
+			for (int n = 0; n < batch; n++) {
 				int i = c + ch * n;
-				float g = gamma[c];
-				for (int j = 0; j < hw; j++) {
-					dxhat(i, j) = delta(i, j) * g;
-				}
+				db += delta.row(i).sum();
+				dg += (delta.row(i).array() * (src.row(i).array() - offset)).sum();
 			}
-		}
+			dg *= scale;
+			dbeta[c] += (float)db;
+			dgamma[c] += (float)dg;
+			s[c] = db;
+			s[ch + c] = dg;
+		};
+
+		auto apply = [&](int c) {
+			float inv_std = 1.f / std::sqrt(var[c] + eps);
+			float offset = low_memory ? mu[c] : 0.f;
+			float scale = low_memory ? inv_std : 1.f;
+			float g = gamma[c];
+			sum1[c] += (float)(g * s[c] / hw);
+			sum2[c] += (float)(g * s[ch + c] / hw);
 
-		// calc Sum(dxhat), Sum(dxhat * xhat)
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
+			float k = inv_std / m;
+			float a = k * m * g;
+			float s1 = k * sum1[c];
+			float s2 = k * sum2[c] * scale;
+			for (int n = 0; n < batch; n++) {
 				int i = c + ch * n;
-				float s1 = 0.f;
-				float s2 = 0.f;
-				for (int j = 0; j < hw; j++) {
-					s1 += dxhat(i, j);
-					s2 += dxhat(i, j) * xhat(i, j);
+				prev_delta.row(i) = delta.row(i).array() * a - s1 - (src.row(i).array() - offset) * s2;
+			}
+		};
+
+		// both passes run while a channel's rows are in cache, unless the sums are shared by replicas
+		if (group == nullptr) {
+			parallel_for(ch, [&](int c0, int c1, int t) {
+				for (int c = c0; c < c1; c++) {
+					reduce(c);
+					apply(c);
+				}
+			});
+			return;
+		}
+
+		parallel_for(ch, [&](int c0, int c1, int t) {
+			for (int c = c0; c < c1; c++) reduce(c);
+		});
+		group->all_reduce(rank, s.data(), 2 * ch);
+		parallel_for(ch, [&](int c0, int c1, int t) {
+			for (int c = c0; c < c1; c++) apply(c);
+		});
+	}
+
+	// Channels-last: each pixel is a contiguous channel vector, so the same reductions run down the
+	// rows, 8 channels at a time in fixed-size packets (the remaining ch % 8 channels one by one).
+	// Sums are kept per sample in float, across the batch in double.
+	void BatchNorm2d::forward_nhwc(const MapXf& prev_out, bool is_training)
+	{
+		if (is_training) {
+			typedef Array<float, 8, 1> Arr8;
+			RowVecXf k = prev_out.row(0);
+			if (group != nullptr) group->broadcast(rank, k.data(), ch);
+			RowVectorXd s1 = RowVectorXd::Zero(ch);
+			RowVectorXd s2 = RowVectorXd::Zero(ch);
+			RowVecXf p1(ch);
+			RowVecXf p2(ch);
+			parallel_for(ch, [&](int c0, int c1, int t) {
+				for (int n = 0; n < batch; n++) {
+					const float* sample = prev_out.data() + (size_t)hw * ch * n;
+					int c = c0;
+					for (; c + 8 <= c1; c += 8) {
+						Map<const Arr8> kc(k.data() + c);
+						Arr8 a1 = Arr8::Zero();
+						Arr8 a2 = Arr8::Zero();
+						const float* x = sample + c;
+						for (int i = 0; i < hw; i++, x += ch) {
+							Arr8 v = Map<const Arr8>(x) - kc;
+							a1 += v;
+							a2 += v * v;
+						}
+						Map<Arr8>(p1.data() + c) = a1;
+						Map<Arr8>(p2.data() + c) = a2;
+					}
+					for (; c < c1; c++) {
+						float a1 = 0.f;
+						float a2 = 0.f;
+						const float* x = sample + c;
+						for (int i = 0; i < hw; i++, x += ch) {
+							float v = *x - k[c];
+							a1 += v;
+							a2 += v * v;
+						}
+						p1[c] = a1;
+						p2[c] = a2;
+					}
+					s1.segment(c0, c1 - c0) += p1.segment(c0, c1 - c0).cast<double>();
+					s2.segment(c0, c1 - c0) += p2.segment(c0, c1 - c0).cast<double>();
 				}
-				sum1[c] += s1 / hw;
-				sum2[c] += s2 / hw;
+			}, 8);
+			if (group != nullptr) {
+				group->all_reduce(rank, s1.data(), ch);
+				group->all_reduce(rank, s2.data(), ch);
 			}
+			double m = (double)global_batch() * hw;
+			RowVectorXd mean = s1 / m;
+			mu = (k.cast<double>() + mean).cast<float>().transpose();
+			var = (s2 / m - mean.cwiseAbs2()).cwiseMax(0.0).cast<float>().transpose();
+
+			move_mu = move_mu * momentum + mu * (1 - momentum);
+			move_var = move_var * momentum + var * (1 - momentum);
 		}
 
-		// calc dx, dgamma, dbeta
-		float m = (float)batch;
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
-				int i = c + ch * n;
-				float s1 = sum1[c];
-				float s2 = sum2[c];
-				float dg = 0.f;
-				float db = 0.f;
-				float denominator = m * std::sqrt(var[c] + eps);
-				for (int j = 0; j < hw; j++) {
-					prev_delta(i, j) = (m * dxhat(i, j)) - s1 - (xhat(i, j) * s2);
-					prev_delta(i, j) /= denominator;
-					dg += (xhat(i, j) * delta(i, j));
-					db += delta(i, j);
+		int rows = batch * hw;
+		RowVecXf m = (is_training ? mu : move_mu).transpose();
+		RowVecXf inv_std = ((is_training ? var : move_var).array() + eps).rsqrt().transpose();
+		RowVecXf g = gamma.transpose();
+		RowVecXf b = beta.transpose();
+		RowVecXf scale = g.cwiseProduct(inv_std);
+		parallel_for(rows, [&](int i0, int i1, int t) {
+			for (int i = i0; i < i1; i++) {
+				if (is_training && !low_memory) {
+					xhat.row(i) = (prev_out.row(i) - m).cwiseProduct(inv_std);
+					output.row(i) = xhat.row(i).cwiseProduct(g) + b;
+				}
+				else {
+					output.row(i) = (prev_out.row(i) - m).cwiseProduct(scale) + b;
+				}
+			}
+		});
+	}
+
+	void BatchNorm2d::backward_nhwc(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		int rows = batch * hw;
+		float m = (float)global_batch();
+		const MapXf& src = low_memory ? prev_out : xhat;
+		RowVecXf inv_std = (var.array() + eps).rsqrt().transpose();
+		RowVecXf offset = low_memory ? RowVecXf(mu.transpose()) : RowVecXf::Zero(ch);
+		RowVecXf scale = low_memory ? inv_std : RowVecXf::Ones(ch);
+
+		typedef Array<float, 8, 1> Arr8;
+		RowVecXf db(ch);
+		RowVecXf dg(ch);
+		parallel_for(ch, [&](int c0, int c1, int t) {
+			int c = c0;
+			for (; c + 8 <= c1; c += 8) {
+				Map<const Arr8> oc(offset.data() + c);
+				Arr8 a1 = Arr8::Zero();
+				Arr8 a2 = Arr8::Zero();
+				const float* d = delta.data() + c;
+				const float* x = src.data() + c;
+				for (int i = 0; i < rows; i++, d += ch, x += ch) {
+					Map<const Arr8> dc(d);
+					a1 += dc;
+					a2 += dc * (Map<const Arr8>(x) - oc);
 				}
-				dgamma[c] += dg;
-				dbeta[c] += db;
+				Map<Arr8>(db.data() + c) = a1;
+				Map<Arr8>(dg.data() + c) = a2;
 			}
+			for (; c < c1; c++) {
+				float a1 = 0.f;
+				float a2 = 0.f;
+				for (int i = 0; i < rows; i++) {
+					a1 += delta(i, c);
+					a2 += delta(i, c) * (src(i, c) - offset[c]);
+				}
+				db[c] = a1;
+				dg[c] = a2;
+			}
+		}, 8);
+		dg = dg.cwiseProduct(scale);
+		dbeta += db.transpose();
+		dgamma += dg.transpose();
+		if (group != nullptr) {
+			group->all_reduce(rank, db.data(), ch);
+			group->all_reduce(rank, dg.data(), ch);
 		}
+		sum1 += gamma.cwiseProduct(db.transpose()) / hw;
+		sum2 += gamma.cwiseProduct(dg.transpose()) / hw;
+
+		RowVecXf k = inv_std / m;
+		RowVecXf a = k.cwiseProduct(gamma.transpose()) * m;
+		RowVecXf s1 = k.cwiseProduct(sum1.transpose());
+		RowVecXf s2 = k.cwiseProduct(sum2.transpose()).cwiseProduct(scale);
+		parallel_for(rows, [&](int i0, int i1, int t) {
+			for (int i = i0; i < i1; i++) {
+				prev_delta.row(i) = delta.row(i).cwiseProduct(a) - s1 - (src.row(i) - offset).cwiseProduct(s2);
+			}
+		});
 	}
 
 	void BatchNorm2d::update_weight(float lr, float decay)
@@ -211,8 +418,6 @@ namespace simple_nn
 
 	void BatchNorm2d::zero_grad()
 	{
-		delta.setZero();
-		dxhat.setZero();
 		dgamma.setZero();
 		dbeta.setZero();
 		sum1.setZero();
@@ -220,4 +425,32 @@ namespace simple_nn
 	}
 
 	vector<int> BatchNorm2d::output_shape() { return { batch, ch, h, w }; }
+
+	Layer* BatchNorm2d::clone() const { return new BatchNorm2d(*this); }
+
+	vector<Param> BatchNorm2d::params()
+	{
+		return {
+			{ move_mu.data(), nullptr, ch },
+			{ move_var.data(), nullptr, ch },
+			{ gamma.data(), dgamma.data(), ch },
+			{ beta.data(), dbeta.data(), ch }
+		};
+	}
+
+	vector<Buffer> BatchNorm2d::buffers() { return { make_buffer(xhat, Lifetime::STEP) }; }
+
+	// The batch the statistics are taken over: that of every replica together.
+	int BatchNorm2d::global_batch() const { return group == nullptr ? batch : batch * group->size(); }
+
+	// Folds the inference transform y = gamma * (x - move_mu) / sqrt(move_var + eps) + beta into the
+	// layer before it: row i of weight (the weights of output channel i) and bias[i].
+	void BatchNorm2d::fold_into(MatXf& weight, float* bias) const
+	{
+		for (int i = 0; i < ch; i++) {
+			float scale = gamma[i] / std::sqrt(move_var[i] + eps);
+			weight.row(i) *= scale;
+			bias[i] = (bias[i] - move_mu[i]) * scale + beta[i];
+		}
+	}
 }
\ No newline at end of file
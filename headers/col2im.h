@@ -1,37 +1,175 @@
 #pragma once
+#include <algorithm>
+#include <Eigen/Dense>
+#include "im2col.h"
 
-void col2im_add_pixel(float* im, int height, int width, int channels,
-                    int row, int col, int channel, int pad, float val)
+// Adds outputs [w0, w1) of one unfolded row back into the image row,
+// skipping the padding; the stride-1 interior is a contiguous vector add.
+void col2im_row(const float* src, int w0, int w1, int w_lo, int w_hi,
+                int stride, float* im_row)
 {
-    row -= pad;
-    col -= pad;
+    int a = std::min(w1, std::max(w0, w_lo));
+    int b = std::max(a, std::min(w1, w_hi));
+    if (stride == 1) {
+        Eigen::Map<Eigen::VectorXf>(im_row + a, b - a) += Eigen::Map<const Eigen::VectorXf>(src + a, b - a);
+    }
+    else {
+        for (int w = a; w < b; ++w) im_row[w * stride] += src[w];
+    }
+}
 
-    if (row < 0 || col < 0 || row >= height || col >= width) return;
-    im[col + width * (row + height * channel)] += val;
+// Accumulates the ksize * ksize rows of data_col that belong to one channel.
+// Channels are independent of each other, so they can be split across threads.
+void col2im_channel(const float* data_col, int height, int width,
+                    int ksize, int stride, int pad, int dilation,
+                    int height_col, int width_col, float* data_im, int col_stride)
+{
+    for (int ki = 0; ki < ksize; ++ki) {
+        int h_lo, h_hi;
+        im2col_valid_range(height, height_col, stride, ki * dilation - pad, h_lo, h_hi);
+        for (int kj = 0; kj < ksize; ++kj) {
+            int w_lo, w_hi;
+            im2col_valid_range(width, width_col, stride, kj * dilation - pad, w_lo, w_hi);
+            const float* src = data_col + (ki * ksize + kj) * col_stride;
+            for (int h = h_lo; h < h_hi; ++h) {
+                float* im_row = data_im + (h * stride + ki * dilation - pad) * width
+                    + kj * dilation - pad;
+                col2im_row(src + h * width_col, 0, width_col, w_lo, w_hi, stride, im_row);
+            }
+        }
+    }
 }
 
-// This one might be too, can't remember.
+// Inverse of im2col: overlapping patches are summed back into data_im.
+// col_stride: distance between two rows of data_col (0 = height_col * width_col).
 void col2im(const float* data_col, int channels, int height, int width,
-            int ksize, int stride, int pad, float* data_im)
+            int ksize, int stride, int pad, int dilation, float* data_im, int col_stride = 0)
 {
-    int c, h, w;
-    int height_col = (height + 2 * pad - ksize) / stride + 1;
-    int width_col = (width + 2 * pad - ksize) / stride + 1;
-
-    int channels_col = channels * ksize * ksize;
-    for (c = 0; c < channels_col; ++c) {
-        int w_offset = c % ksize;
-        int h_offset = (c / ksize) % ksize;
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+
+    if (col_stride == 0) col_stride = height_col * width_col;
+
+    for (int c = 0; c < channels; ++c) {
+        col2im_channel(data_col + c * ksize * ksize * col_stride, height, width, ksize, stride, pad,
+            dilation, height_col, width_col, data_im + c * height * width, col_stride);
+    }
+}
+
+// Adds a rows x cols panel holding rows [row0, row0 + rows) and columns
+// [col0, col0 + cols) of the im2col matrix back into the image.
+void col2im_panel(const float* panel, int channels, int height, int width,
+                  int ksize, int stride, int pad, int dilation,
+                  int row0, int rows, int col0, int cols, float* data_im)
+{
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+
+    for (int r = 0; r < rows; ++r) {
+        int c = row0 + r;
+        int kj = c % ksize;
+        int ki = (c / ksize) % ksize;
         int c_im = c / ksize / ksize;
-        for (h = 0; h < height_col; ++h) {
-            for (w = 0; w < width_col; ++w) {
-                int im_row = h_offset + h * stride;
-                int im_col = w_offset + w * stride;
-                int col_index = (c * height_col + h) * width_col + w;
-                float val = data_col[col_index];
-                col2im_add_pixel(data_im, height, width, channels,
-                    im_row, im_col, c_im, pad, val);
+        int h_lo, h_hi, w_lo, w_hi;
+        im2col_valid_range(height, height_col, stride, ki * dilation - pad, h_lo, h_hi);
+        im2col_valid_range(width, width_col, stride, kj * dilation - pad, w_lo, w_hi);
+
+        const float* src = panel + r * cols - col0;
+        for (int p = col0; p < col0 + cols;) {
+            int h = p / width_col;
+            int w0 = p - h * width_col;
+            int w1 = std::min(width_col, w0 + col0 + cols - p);
+            if (h >= h_lo && h < h_hi) {
+                float* im_row = data_im + (c_im * height + h * stride + ki * dilation - pad) * width
+                    + kj * dilation - pad;
+                col2im_row(src + h * width_col, w0, w1, w_lo, w_hi, stride, im_row);
             }
+            p += w1 - w0;
+        }
+    }
+}
+
+// Inverse of im2col_nhwc: every tap of every output pixel is added back into the
+// (height x width x channels) image as a contiguous channel vector.
+void col2im_nhwc(const float* data_col, int channels, int height, int width,
+                 int ksize, int stride, int pad, int dilation, int groups, float* data_im)
+{
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int cg = channels / groups;
+    int group_len = cg * ksize * ksize;
+
+    if (groups == 1 && dilation == 1) {
+        // the ksize taps of a kernel row are adjacent pixels, i.e. one span of ksize * channels
+        for (int h = 0; h < height_col; ++h) {
+            for (int w = 0; w < width_col; ++w) {
+                const float* src = data_col + (h * width_col + w) * group_len;
+                int w_start = w * stride - pad;
+                int lo = std::max(0, -w_start) * channels;
+                int hi = std::max(lo, std::min(ksize, width - w_start) * channels);
+                for (int ki = 0; ki < ksize; ++ki) {
+                    int hh = h * stride + ki - pad;
+                    if (hh < 0 || hh >= height) continue;
+                    float* dst = data_im + (hh * width + w_start) * channels;
+                    Eigen::Map<Eigen::VectorXf>(dst + lo, hi - lo) +=
+                        Eigen::Map<const Eigen::VectorXf>(src + ki * ksize * channels + lo, hi - lo);
+                }
+            }
+        }
+        return;
+    }
+
+    for (int h = 0; h < height_col; ++h) {
+        for (int w = 0; w < width_col; ++w) {
+            const float* src = data_col + (h * width_col + w) * channels * ksize * ksize;
+            for (int ki = 0; ki < ksize; ++ki) {
+                int hh = h * stride + ki * dilation - pad;
+                if (hh < 0 || hh >= height) continue;
+                for (int kj = 0; kj < ksize; ++kj) {
+                    int ww = w * stride + kj * dilation - pad;
+                    if (ww < 0 || ww >= width) continue;
+                    float* dst = data_im + (hh * width + ww) * channels;
+                    for (int g = 0; g < groups; ++g) {
+                        Eigen::Map<Eigen::VectorXf>(dst + g * cg, cg) +=
+                            Eigen::Map<const Eigen::VectorXf>(src + g * group_len + (ki * ksize + kj) * cg, cg);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// col2im for a fixed ksize x ksize kernel, stride and padding (dilation 1).
+template<int K, int S, int P>
+void col2im_k(const float* data_col, int channels, int height, int width,
+              float* data_im, int col_stride = 0)
+{
+    int height_col = (height + 2 * P - K) / S + 1;
+    int width_col = (width + 2 * P - K) / S + 1;
+
+    if (col_stride == 0) col_stride = height_col * width_col;
+
+    for (int c = 0; c < channels; ++c) {
+        float* im = data_im + c * height * width;
+        const float* col = data_col + c * K * K * col_stride;
+        for (int h = 0; h < height_col; ++h) {
+            unroll(std::make_integer_sequence<int, K>(), [&](auto ki) {
+                int hh = h * S + ki - P;
+                if (hh < 0 || hh >= height) return;
+                unroll(std::make_integer_sequence<int, K>(), [&](auto kj) {
+                    constexpr int w_lo = kj < P ? (P - kj + S - 1) / S : 0;
+                    const float* src = col + (ki * K + kj) * col_stride + h * width_col;
+                    int w_hi = std::max(w_lo, std::min(width_col, (width - 1 + P - kj) / S + 1));
+                    float* im_row = im + hh * width + kj - P;
+                    if (S == 1) {
+                        Eigen::Map<Eigen::VectorXf>(im_row + w_lo, w_hi - w_lo) +=
+                            Eigen::Map<const Eigen::VectorXf>(src + w_lo, w_hi - w_lo);
+                    }
+                    else {
+                        for (int w = w_lo; w < w_hi; ++w) im_row[w * S] += src[w];
+                    }
+                });
+            });
         }
     }
 }
@@ -9,6 +9,7 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <chrono>
 #include <random>
 #include <assert.h>
@@ -27,6 +28,9 @@ namespace simple_nn
 	typedef Matrix<float, 1, Dynamic> RowVecXf;
 	typedef Matrix<int, Dynamic, Dynamic, RowMajor> MatXi;
 	typedef Matrix<int, Dynamic, 1> VecXi;
+	// views of the buffers SimpleNN::compile places in its arena (see Layer::buffers)
+	typedef Map<MatXf> MapXf;
+	typedef Map<VecXi> MapXi;
 
 	void write_file(const MatXf& data, int channels, string fname)
 	{
@@ -113,6 +117,14 @@ namespace simple_nn
 		}
 	}
 
+	// (batch * channels) x hw -> (batch * hw) x channels
+	void nchw_to_nhwc(const MatXf& src, int batch, int channels, int hw, MapXf& dst)
+	{
+		for (int n = 0; n < batch; n++) {
+			dst.middleRows(hw * n, hw) = src.middleRows(channels * n, channels).transpose();
+		}
+	}
+
 	int calc_outsize(int in_size, int kernel_size, int stride, int pad)
 	{
 		return (int)std::floor((in_size + 2 * pad - kernel_size) / stride) + 1;
@@ -18,8 +18,14 @@ namespace simple_nn
 		std::string activ;
 		std::string init;
 		std::string loss;
+		std::string layout;
+		std::string master_addr;
 		int batch;
 		int epoch;
+		int threads;
+		int replicas;
+		int rank;
+		int world_size;
 		float lr;
 		float decay;
 		bool use_batchnorm;
@@ -43,8 +49,14 @@ namespace simple_nn
 		activ("relu"),
 		init("lecun_uniform"),
 		loss("cross_entropy"),
+		layout("nchw"),
+		master_addr("127.0.0.1:29500"),
 		batch(32),
 		epoch(30),
+		threads(1),
+		replicas(1),
+		rank(0),
+		world_size(1),
 		lr(0.01f),
 		decay(0.f),
 		use_batchnorm(false),
@@ -97,6 +109,10 @@ namespace simple_nn
 					it++;
 					loss = *it;
 				}
+				else if ((*it) == "layout") {
+					it++;
+					layout = *it;
+				}
 				else if ((*it) == "batch") {
 					it++;
 					batch = std::stoi(*it);
@@ -105,6 +121,26 @@ namespace simple_nn
 					it++;
 					epoch = std::stoi(*it);
 				}
+				else if ((*it) == "threads") {
+					it++;
+					threads = std::stoi(*it);
+				}
+				else if ((*it) == "replicas") {
+					it++;
+					replicas = std::stoi(*it);
+				}
+				else if ((*it) == "rank") {
+					it++;
+					rank = std::stoi(*it);
+				}
+				else if ((*it) == "world_size") {
+					it++;
+					world_size = std::stoi(*it);
+				}
+				else if ((*it) == "master_addr") {
+					it++;
+					master_addr = *it;
+				}
 				else if ((*it) == "lr") {
 					it++;
 					lr = std::stof(*it);
@@ -157,8 +193,14 @@ namespace simple_nn
 		std::cout << "  --activ         = " << activ << std::endl;
 		std::cout << "  --init          = " << init << std::endl;
 		std::cout << "  --loss          = " << loss << std::endl;
+		std::cout << "  --layout        = " << layout << std::endl;
 		std::cout << "  --batch         = " << batch << std::endl;
 		std::cout << "  --epoch         = " << epoch << std::endl;
+		std::cout << "  --threads       = " << threads << std::endl;
+		std::cout << "  --replicas      = " << replicas << std::endl;
+		std::cout << "  --rank          = " << rank << std::endl;
+		std::cout << "  --world_size    = " << world_size << std::endl;
+		std::cout << "  --master_addr   = " << master_addr << std::endl;
 		std::cout << "  --lr            = " << lr << std::endl;
 		std::cout << "  --decay         = " << decay << std::endl;
 		std::cout << "  --use_batchnorm = " << use_batchnorm << std::endl;
@@ -179,8 +221,14 @@ namespace simple_nn
 		std::cout << "  --init          = Weight initialization (default: lecun_uniform)" << std::endl;
 		std::cout << "                    (options: lecun_uniform, lecun_normal, xavier_uniform, xavier_normal, kaiming_uniform, kaiming_normal)" << std::endl;
 		std::cout << "  --loss          = Loss function for training (options: cross_entropy, mse; default: cross_entropy)" << std::endl;
+		std::cout << "  --layout        = Memory layout of 2d layers (options: nchw, nhwc; default: nchw)" << std::endl;
 		std::cout << "  --batch         = Batch size (default: 32)" << std::endl;
 		std::cout << "  --epoch         = Total epochs (default: 30)" << std::endl;
+		std::cout << "  --threads       = Threads per layer kernel (default: 1)" << std::endl;
+		std::cout << "  --replicas      = Data-parallel model replicas, each training on a shard of the batch (default: 1)" << std::endl;
+		std::cout << "  --rank          = Rank of this process in distributed training (default: 0)" << std::endl;
+		std::cout << "  --world_size    = Training processes, each training on a shard of the dataset (default: 1)" << std::endl;
+		std::cout << "  --master_addr   = Address (host:port) where rank 0 meets the others (default: 127.0.0.1:29500)" << std::endl;
 		std::cout << "  --lr            = Learning rate (default: 0.01)" << std::endl;
 		std::cout << "  --decay         = L2 regularization (default: 0)" << std::endl;
 		std::cout << "  --use_batchnorm = Use batch normalization (options: 0, 1; default: 0)" << std::endl;
@@ -239,5 +287,25 @@ namespace simple_nn
 			std::cout << "Invalid loss function." << std::endl;
 			exit(1);
 		}
+
+		if (layout != "nchw" && layout != "nhwc") {
+			std::cout << "Invalid layout." << std::endl;
+			exit(1);
+		}
+
+		if (threads < 1) {
+			std::cout << "Invalid number of threads." << std::endl;
+			exit(1);
+		}
+
+		if (replicas < 1 || batch % replicas != 0) {
+			std::cout << "The number of replicas must divide the batch size." << std::endl;
+			exit(1);
+		}
+
+		if (world_size < 1 || rank < 0 || rank >= world_size) {
+			std::cout << "Invalid rank or world size." << std::endl;
+			exit(1);
+		}
 	}
 }
\ No newline at end of file
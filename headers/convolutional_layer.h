@@ -1,11 +1,36 @@
 #pragma once
 #include "layer.h"
+#include "winograd.h"
+#include "fft.h"
 
 namespace simple_nn
 {
+	enum class ConvAlgo
+	{
+		IM2COL,
+		IMPLICIT_GEMM,
+		WINOGRAD_2X2,	// F(2x2, 3x3) or F(2x2, 5x5)
+		WINOGRAD_4X4,	// F(4x4, 3x3); F(2x2, 5x5) for 5x5 kernels
+		DEPTHWISE,		// direct kernel, chosen automatically when groups == in_channels
+		TILED,			// im2col over tiles of output pixels that fit the workspace limit, chosen
+						// automatically when the unfolded input of one sample does not fit
+		FFT				// products of 2d spectra for dense stride-1 convolutions, chosen automatically
+						// over IM2COL for large kernels when the cost model favors it
+	};
+
+	// With Layout::NHWC the kernel rows are ordered (ki, kj, channel) instead of (channel, ki, kj)
+	// and every algorithm but DEPTHWISE (with out_channels == in_channels) runs as IM2COL.
+
+	// scratch budget of a single packed panel in the implicit GEMM path
+	const size_t CONV_PANEL_BYTES = 128 << 10;
+
+	// IM2COL switches to FFT when the estimated GEMM flops exceed the FFT flops by this factor,
+	// which accounts for the GEMM running closer to peak than the transforms
+	const float CONV_FFT_THRESHOLD = 8.f;
+
 	class Conv2d : public Layer
 	{
-	private:
+	protected:
 		int batch;
 		int ic;
 		int oc;
@@ -18,21 +43,86 @@ namespace simple_nn
 		int kh;
 		int kw;
 		int pad;
+		int stride;
+		int dilation;
+		int groups;
+		int sub_batch;
+		int panel_rows;
+		int panel_cols;
+		int tile_cols;
+		int wino_batch;
+		int cached_chunks;
+		bool cache_valid;
+		size_t max_workspace;
+		size_t max_cache;
+		ConvAlgo algo;
 		string option;
 		MatXf dkernel;
 		VecXf dbias;
-		MatXf im_col;
+		vector<MatXf> dkernel_part;	// per-thread gradients of the paths that split the batch, summed in thread order
+		vector<VecXf> dbias_part;
+		MapXf im_col;
+		MapXf col_buf;
+		MapXf col_cache;
+		WinogradTile wino;
+		MatXf wino_kernel;
+		MatXf wino_U;
+		MatXf wino_Ub;
+		MapXf wino_V;
+		MapXf wino_M;
+		vector<FFT2d> fft;		// one per thread, since a transform uses the scratch of its FFT2d
+		MatXf fft_kernel;
+		MatXcf fft_W;
+		MatXcf fft_dW;
+		MatXcf fft_X;
+		MatXcf fft_Y;
 	public:
 		MatXf kernel;
 		VecXf bias;
 		Conv2d(int in_channels, int out_channels, int kernel_size, int padding,
-			string option);
+			string option, int stride = 1, int dilation = 1, int groups = 1);
+		void set_workspace_limit(size_t bytes);
+		void set_algorithm(ConvAlgo algorithm);
+		void set_unfold_cache(size_t bytes);
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		void update_weight(float lr, float decay) override;
 		void zero_grad() override;
 		vector<int> output_shape() override;
+		Layer* specialize() override;
+		Layer* clone() const override;
+		vector<Param> params() override;
+		vector<Buffer> buffers() override;
+		MatXf reorder_kernel(const MatXf& src, Layout from, Layout to) const;
+	protected:
+		virtual void im2col_sample(const float* im, int channels, float* cols, int ld);
+		virtual void col2im_sample(const float* cols, int channels, float* im, int ld);
+	private:
+		void forward_im2col(const MapXf& prev_out, bool is_training);
+		void backward_im2col(const MapXf& prev_out, MapXf& prev_delta, bool calc_dx = true);
+		void forward_implicit(const MapXf& prev_out);
+		void backward_implicit(const MapXf& prev_out, MapXf& prev_delta);
+		void forward_tiled(const MapXf& prev_out);
+		void backward_tiled(const MapXf& prev_out, MapXf& prev_delta);
+		void forward_winograd(const MapXf& prev_out);
+		void backward_winograd(const MapXf& prev_out, MapXf& prev_delta);
+		void update_winograd_filters();
+		void forward_fft(const MapXf& prev_out);
+		void backward_fft(const MapXf& prev_out, MapXf& prev_delta);
+		void update_fft_filters();
+		bool fft_preferred(int nh, int nw) const;
+		void forward_depthwise(const MapXf& prev_out);
+		void backward_depthwise(const MapXf& prev_out, MapXf& prev_delta);
+		void forward_nhwc(const MapXf& prev_out, bool is_training);
+		void backward_nhwc(const MapXf& prev_out, MapXf& prev_delta);
+		void forward_depthwise_nhwc(const MapXf& prev_out);
+		void backward_depthwise_nhwc(const MapXf& prev_out, MapXf& prev_delta);
+		float* unfold(const MapXf& prev_out, int n0, int nb, int g, int t, int& ld);
+		const float* unfold_nhwc(const MapXf& prev_out, int n0, int nb, int t);
+		MatXf& partial_dkernel(int t);
+		VecXf& partial_dbias(int t);
+		void add_partial_grads();
 	};
 
 	Conv2d::Conv2d(
@@ -40,7 +130,10 @@ namespace simple_nn
 		int out_channels,
 		int kernel_size,
 		int padding,
-		string option
+		string option,
+		int stride,
+		int dilation,
+		int groups
 	) :
 		Layer(LayerType::CONV2D),
 		batch(0),
@@ -55,7 +148,31 @@ namespace simple_nn
 		kh(kernel_size),
 		kw(kernel_size),
 		pad(padding),
-		option(option) {}
+		stride(stride),
+		dilation(dilation),
+		groups(groups),
+		sub_batch(1),
+		panel_rows(0),
+		panel_cols(0),
+		tile_cols(0),
+		wino_batch(1),
+		cached_chunks(0),
+		cache_valid(false),
+		max_workspace(8 << 20),
+		max_cache(0),
+		algo(ConvAlgo::IM2COL),
+		option(option),
+		im_col(nullptr, 0, 0),
+		col_buf(nullptr, 0, 0),
+		col_cache(nullptr, 0, 0),
+		wino_V(nullptr, 0, 0),
+		wino_M(nullptr, 0, 0) {}
+
+	void Conv2d::set_workspace_limit(size_t bytes) { max_workspace = bytes; }
+
+	void Conv2d::set_algorithm(ConvAlgo algorithm) { algo = algorithm; }
+
+	void Conv2d::set_unfold_cache(size_t bytes) { max_cache = bytes; }
 
 	void Conv2d::set_layer(const vector<int>& input_shape)
 	{
@@ -64,50 +181,814 @@ namespace simple_nn
 		ih = input_shape[2];
 		iw = input_shape[3];
 		ihw = ih * iw;
-		oh = calc_outsize(ih, kh, 1, pad);
-		ow = calc_outsize(iw, kw, 1, pad);
+		oh = calc_outsize(ih, dilation * (kh - 1) + 1, stride, pad);
+		ow = calc_outsize(iw, dilation * (kw - 1) + 1, stride, pad);
 		ohw = oh * ow;
 
-		output.resize(batch * oc, ohw);
-		delta.resize(batch * oc, ohw);
-		kernel.resize(oc, ic * kh * kw);
-		dkernel.resize(oc, ic * kh * kw);
+		assert(ic % groups == 0 && oc % groups == 0 && "Conv2d::set_layer(const vector<int>&): Channels must be divisible by groups.");
+		int K = (ic / groups) * kh * kw;
+		int threads = n_threads();
+		int per_thread = (batch + threads - 1) / threads;
+
+		if (layout == Layout::NHWC) {
+			reshape(output, batch * ohw, oc);
+			reshape(delta, batch * ohw, oc);
+		}
+		else {
+			reshape(output, batch * oc, ohw);
+			reshape(delta, batch * oc, ohw);
+		}
+		kernel.resize(oc, K);
+		dkernel.resize(inference_only ? 0 : oc, K);
 		bias.resize(oc);
-		dbias.resize(oc);
-		im_col.resize(ic * kh * kw, ohw);
+		dbias.resize(inference_only ? 0 : oc);
+
+		if (groups > 1 && groups == ic) {
+			algo = ConvAlgo::DEPTHWISE;
+		}
+
+		if (layout == Layout::NHWC && algo != ConvAlgo::IM2COL && !(algo == ConvAlgo::DEPTHWISE && oc == ic)) {
+			algo = ConvAlgo::IM2COL;
+		}
+
+		if (algo == ConvAlgo::WINOGRAD_2X2 || algo == ConvAlgo::WINOGRAD_4X4) {
+			// Winograd needs dense stride-1 3x3 or 5x5 kernels and padding the backward pass can mirror
+			int m = (algo == ConvAlgo::WINOGRAD_4X4 && kh == 3) ? 4 : 2;
+			bool dense = stride == 1 && dilation == 1 && groups == 1;
+			if (dense && kh == kw && winograd_supported(m, kh) && pad <= kh - 1) {
+				wino = winograd_tile(m, kh);
+				int aa = wino.alpha * wino.alpha;
+				int tiles_fwd = ((oh + m - 1) / m) * ((ow + m - 1) / m);
+				int tiles_bwd = ((ih + m - 1) / m) * ((iw + m - 1) / m);
+				int tiles = inference_only ? tiles_fwd : std::max(tiles_fwd, tiles_bwd);
+				size_t sample_bytes = sizeof(float) * (size_t)aa * (ic + oc) * tiles;
+				wino_batch = (int)std::max<size_t>(1, std::min<size_t>(per_thread, max_workspace / sample_bytes));
+				// each thread has its own aa * max(ic, oc) rows of both
+				reshape(wino_V, threads * aa * std::max(ic, oc), wino_batch * tiles);
+				reshape(wino_M, threads * aa * std::max(ic, oc), wino_batch * tiles);
+				wino_kernel.resize(0, 0);
+			}
+			else {
+				algo = ConvAlgo::IM2COL;
+			}
+		}
 
-		int fan_in = kh * kw * ic;
-		int fan_out = kh * kw * oc;
+		if ((algo == ConvAlgo::FFT || algo == ConvAlgo::IM2COL) && layout == Layout::NCHW) {
+			// the spectra are taken on a grid that holds the padded input, so that the circular
+			// correlations of the forward and both backward passes do not wrap around
+			int nh = fft_good_size(ih + 2 * pad);
+			int nw = fft_good_size(iw + 2 * pad);
+			bool dense = stride == 1 && dilation == 1 && groups == 1;
+			if (dense && (algo == ConvAlgo::FFT || fft_preferred(nh, nw))) {
+				algo = ConvAlgo::FFT;
+				fft.assign(threads, FFT2d(nh, nw));
+				int F = fft[0].spectrum_size();
+				// each thread has its own ic rows of fft_X, oc rows of fft_Y and oc * ic rows of fft_dW
+				fft_W.resize(oc * ic, F);
+				fft_dW.resize(inference_only ? 0 : threads * oc * ic, F);
+				fft_X.resize(threads * ic, F);
+				fft_Y.resize(threads * oc, F);
+				fft_kernel.resize(0, 0);
+			}
+			else {
+				algo = ConvAlgo::IM2COL;
+			}
+		}
+
+		if (algo == ConvAlgo::IM2COL && layout == Layout::NCHW && sizeof(float) * (size_t)(K + oc) * ohw > max_workspace) {
+			algo = ConvAlgo::TILED;
+		}
+
+		if (algo == ConvAlgo::DEPTHWISE && layout == Layout::NHWC) {
+			// im_col holds the kernel and col_buf the gradient of each thread as (kh * kw) x channels
+			reshape(im_col, kh * kw, oc);
+			reshape(col_buf, inference_only ? 0 : threads * kh * kw, oc);
+		}
+		else if (algo == ConvAlgo::DEPTHWISE || algo == ConvAlgo::FFT) {
+			reshape(im_col, 0, 0);
+			reshape(col_buf, 0, 0);
+		}
+		else if (algo == ConvAlgo::IMPLICIT_GEMM) {
+			// im_col only holds one cache-sized panel of the unfolded input per thread
+			size_t panel_size = CONV_PANEL_BYTES / sizeof(float);
+			panel_rows = std::min(K, 256);
+			panel_cols = (int)std::max<size_t>(1, std::min<size_t>(ohw, panel_size / panel_rows));
+			reshape(im_col, panel_rows, threads * panel_cols);
+			reshape(col_buf, 0, 0);
+		}
+		else if (algo == ConvAlgo::TILED) {
+			// a tile is as many whole output rows as fit, or part of one row on very wide inputs;
+			// its columns read the input rows under the tile plus the kernel's halo. Each thread
+			// has its own tile of im_col.
+			size_t row_bytes = sizeof(float) * (size_t)K * ow;
+			if (row_bytes <= max_workspace) {
+				tile_cols = (int)std::min<size_t>(oh, max_workspace / row_bytes) * ow;
+			}
+			else {
+				tile_cols = (int)std::max<size_t>(1, max_workspace / (sizeof(float) * K));
+			}
+			reshape(im_col, K, threads * tile_cols);
+			reshape(col_buf, 0, 0);
+		}
+		else if (layout == Layout::NHWC) {
+			// im_col holds the unfolded inputs of sub_batch samples, one output pixel per row,
+			// and col_buf their gradients; each thread has its own sub_batch * ohw rows of both
+			size_t sample_bytes = sizeof(float) * (size_t)2 * groups * K * ohw;
+			sub_batch = (int)std::max<size_t>(1, std::min<size_t>(per_thread, max_workspace / sample_bytes));
+			reshape(im_col, threads * sub_batch * ohw, groups * K);
+			reshape(col_buf, inference_only ? 0 : threads * sub_batch * ohw, groups * K);
+		}
+		else {
+			// im_col and col_buf hold the unfolded inputs (of one group) and outputs of
+			// sub_batch samples side by side, so that a sub-batch is convolved by one GEMM per group;
+			// each thread has its own sub_batch * ohw columns of both
+			size_t sample_bytes = sizeof(float) * (size_t)(K + oc) * ohw;
+			sub_batch = (int)std::max<size_t>(1, std::min<size_t>(per_thread, max_workspace / sample_bytes));
+			reshape(im_col, K, threads * sub_batch * ohw);
+			reshape(col_buf, oc, threads * sub_batch * ohw);
+		}
+
+		// every path but the channels-first DEPTHWISE (split by channels) splits the batch across
+		// threads, each summing its own weight gradient
+		bool split = !(algo == ConvAlgo::DEPTHWISE && layout == Layout::NCHW);
+		dkernel_part.assign(split && threads > 1 && !inference_only ? threads : 0, MatXf(oc, K));
+		dbias_part.assign(dkernel_part.size(), VecXf(oc));
+
+		// keep the unfolded inputs of as many sub-batches as max_cache allows for backward
+		cached_chunks = 0;
+		cache_valid = false;
+		if (algo == ConvAlgo::IM2COL && max_cache > 0 && !inference_only) {
+			size_t chunk_bytes = sizeof(float) * (size_t)ic * kh * kw * sub_batch * ohw;
+			int n_chunks = (batch + sub_batch - 1) / sub_batch;
+			cached_chunks = (int)std::min<size_t>(n_chunks, max_cache / chunk_bytes);
+		}
+		if (layout == Layout::NHWC) {
+			reshape(col_cache, std::min(batch, cached_chunks * sub_batch) * ohw, groups * K);
+		}
+		else {
+			reshape(col_cache, groups * K, std::min(batch, cached_chunks * sub_batch) * ohw);
+		}
+
+		int fan_in = K;
+		int fan_out = kh * kw * oc / groups;
 		init_weight(kernel, fan_in, fan_out, option);
 		bias.setZero();
 	}
 
-	void Conv2d::forward(const MatXf& prev_out, bool is_training)
+	void Conv2d::forward(const MapXf& prev_out, bool is_training)
 	{
-		for (int n = 0; n < batch; n++) {
-			const float* im = prev_out.data() + (ic * ihw) * n;
-			im2col(im, ic, ih, iw, kh, 1, pad, im_col.data());
-			output.block(oc * n, 0, oc, ohw).noalias() = kernel * im_col;
-			output.block(oc * n, 0, oc, ohw).colwise() += bias;
+		if (layout == Layout::NHWC) {
+			if (algo == ConvAlgo::DEPTHWISE) forward_depthwise_nhwc(prev_out);
+			else forward_nhwc(prev_out, is_training);
+		}
+		else if (algo == ConvAlgo::IMPLICIT_GEMM) {
+			forward_implicit(prev_out);
+		}
+		else if (algo == ConvAlgo::TILED) {
+			forward_tiled(prev_out);
+		}
+		else if (algo == ConvAlgo::WINOGRAD_2X2 || algo == ConvAlgo::WINOGRAD_4X4) {
+			forward_winograd(prev_out);
+		}
+		else if (algo == ConvAlgo::DEPTHWISE) {
+			forward_depthwise(prev_out);
+		}
+		else if (algo == ConvAlgo::FFT) {
+			forward_fft(prev_out);
+		}
+		else {
+			forward_im2col(prev_out, is_training);
 		}
 	}
 
-	void Conv2d::backward(const MatXf& prev_out, MatXf& prev_delta)
+	void Conv2d::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
-		for (int n = 0; n < batch; n++) {
-			const float* im = prev_out.data() + (ic * ihw) * n;
-			im2col(im, ic, ih, iw, kh, 1, pad, im_col.data());
-			dkernel += delta.block(oc * n, 0, oc, ohw) * im_col.transpose();
-			dbias += delta.block(oc * n, 0, oc, ohw).rowwise().sum();
+		if (layout == Layout::NHWC) {
+			if (algo == ConvAlgo::DEPTHWISE) backward_depthwise_nhwc(prev_out, prev_delta);
+			else backward_nhwc(prev_out, prev_delta);
+		}
+		else if (algo == ConvAlgo::IMPLICIT_GEMM) {
+			backward_implicit(prev_out, prev_delta);
 		}
+		else if (algo == ConvAlgo::TILED) {
+			backward_tiled(prev_out, prev_delta);
+		}
+		else if (algo == ConvAlgo::WINOGRAD_2X2 || algo == ConvAlgo::WINOGRAD_4X4) {
+			backward_winograd(prev_out, prev_delta);
+		}
+		else if (algo == ConvAlgo::DEPTHWISE) {
+			backward_depthwise(prev_out, prev_delta);
+		}
+		else if (algo == ConvAlgo::FFT) {
+			backward_fft(prev_out, prev_delta);
+		}
+		else {
+			backward_im2col(prev_out, prev_delta);
+		}
+	}
+
+	void Conv2d::im2col_sample(const float* im, int channels, float* cols, int ld)
+	{
+		im2col(im, channels, ih, iw, kh, stride, pad, dilation, cols, ld);
+	}
+
+	void Conv2d::col2im_sample(const float* cols, int channels, float* im, int ld)
+	{
+		col2im(cols, channels, ih, iw, kh, stride, pad, dilation, im, ld);
+	}
+
+	// Unfolds group g of samples [n0, n0 + nb) into the scratch of thread t and returns the
+	// K x (nb * ohw) matrix with row stride ld. Sub-batches within the unfold cache are read from
+	// and written to it.
+	float* Conv2d::unfold(const MapXf& prev_out, int n0, int nb, int g, int t, int& ld)
+	{
+		int icg = ic / groups;
+		int K = icg * kh * kw;
+		bool cached = n0 / sub_batch < cached_chunks;
+		float* cols = cached ? col_cache.data() + col_cache.cols() * K * g + ohw * n0 : im_col.data() + sub_batch * ohw * t;
+		ld = cached ? (int)col_cache.cols() : (int)im_col.cols();
+
+		if (cached && cache_valid) return cols;
+
+		for (int s = 0; s < nb; s++) {
+			const float* im = prev_out.data() + ihw * (icg * g + ic * (n0 + s));
+			im2col_sample(im, icg, cols + ohw * s, ld);
+		}
+		return cols;
+	}
+
+	// Sub-batches are split across threads, each with its own columns of im_col and col_buf.
+	void Conv2d::forward_im2col(const MapXf& prev_out, bool is_training)
+	{
+		int K = (ic / groups) * kh * kw;
+		int ocg = oc / groups;
+		int n_chunks = (batch + sub_batch - 1) / sub_batch;
+		cache_valid = false;
+		parallel_for(n_chunks, [&](int c0, int c1, int t) {
+			int first = sub_batch * ohw * t;
+			for (int n0 = sub_batch * c0; n0 < std::min(batch, sub_batch * c1); n0 += sub_batch) {
+				int nb = std::min(sub_batch, batch - n0);
+				for (int g = 0; g < groups; g++) {
+					int ld;
+					float* data = unfold(prev_out, n0, nb, g, t, ld);
+					Map<MatXf, 0, OuterStride<>> cols(data, K, nb * ohw, OuterStride<>(ld));
+					col_buf.block(ocg * g, first, ocg, nb * ohw).noalias() = kernel.middleRows(ocg * g, ocg) * cols;
+				}
+				for (int s = 0; s < nb; s++) {
+					output.block(oc * (n0 + s), 0, oc, ohw) = col_buf.middleCols(first + ohw * s, ohw);
+					output.block(oc * (n0 + s), 0, oc, ohw).colwise() += bias;
+				}
+			}
+		});
+		cache_valid = cached_chunks > 0 && is_training;
+	}
+
+	void Conv2d::backward_im2col(const MapXf& prev_out, MapXf& prev_delta, bool calc_dx)
+	{
+		int icg = ic / groups;
+		int K = icg * kh * kw;
+		int ocg = oc / groups;
+		int ld_dx = (int)im_col.cols();
+		int n_chunks = (batch + sub_batch - 1) / sub_batch;
+		parallel_for(n_chunks, [&](int c0, int c1, int t) {
+			int first = sub_batch * ohw * t;
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+
+			for (int n0 = sub_batch * c0; n0 < std::min(batch, sub_batch * c1); n0 += sub_batch) {
+				int nb = std::min(sub_batch, batch - n0);
+				for (int s = 0; s < nb; s++) {
+					col_buf.middleCols(first + ohw * s, ohw) = delta.block(oc * (n0 + s), 0, oc, ohw);
+				}
+				db += col_buf.middleCols(first, nb * ohw).rowwise().sum();
+
+				for (int g = 0; g < groups; g++) {
+					auto d = col_buf.block(ocg * g, first, ocg, nb * ohw);
+					int ld;
+					float* data = unfold(prev_out, n0, nb, g, t, ld);
+					Map<MatXf, 0, OuterStride<>> cols(data, K, nb * ohw, OuterStride<>(ld));
+					dk.middleRows(ocg * g, ocg).noalias() += d * cols.transpose();
+
+					if (calc_dx && !is_first) {
+						im_col.middleCols(first, nb * ohw).noalias() = kernel.middleRows(ocg * g, ocg).transpose() * d;
+						for (int s = 0; s < nb; s++) {
+							float* begin = prev_delta.data() + ihw * (icg * g + ic * (n0 + s));
+							col2im_sample(im_col.data() + first + ohw * s, icg, begin, ld_dx);
+						}
+					}
+				}
+			}
+		});
+		add_partial_grads();
+	}
+
+	// The weight gradient thread t sums into during a backward pass: its own part, zeroed, when
+	// the batch is split across threads (see add_partial_grads), otherwise dkernel itself.
+	MatXf& Conv2d::partial_dkernel(int t)
+	{
+		if (dkernel_part.empty()) return dkernel;
+		dkernel_part[t].setZero();
+		return dkernel_part[t];
+	}
+
+	VecXf& Conv2d::partial_dbias(int t)
+	{
+		if (dbias_part.empty()) return dbias;
+		dbias_part[t].setZero();
+		return dbias_part[t];
+	}
+
+	void Conv2d::add_partial_grads()
+	{
+		for (int t = 0; t < (int)dkernel_part.size(); t++) {
+			dkernel += dkernel_part[t];
+			dbias += dbias_part[t];
+		}
+	}
+
+	// The samples are split across threads, each with its own panel of im_col.
+	void Conv2d::forward_implicit(const MapXf& prev_out)
+	{
+		int icg = ic / groups;
+		int ocg = oc / groups;
+		int K = icg * kh * kw;
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			float* scratch = im_col.data() + (size_t)panel_rows * panel_cols * t;
+			for (int n = n0; n < n1; n++) {
+				for (int g = 0; g < groups; g++) {
+					const float* im = prev_out.data() + ihw * (icg * g + ic * n);
+					auto w = kernel.middleRows(ocg * g, ocg);
+					for (int p0 = 0; p0 < ohw; p0 += panel_cols) {
+						int np = std::min(panel_cols, ohw - p0);
+						auto out = output.block(ocg * g + oc * n, p0, ocg, np);
+						out.colwise() = bias.segment(ocg * g, ocg);
+						for (int k0 = 0; k0 < K; k0 += panel_rows) {
+							int nk = std::min(panel_rows, K - k0);
+							im2col_panel(im, icg, ih, iw, kh, stride, pad, dilation, k0, nk, p0, np, scratch);
+							Map<MatXf> panel(scratch, nk, np);
+							out.noalias() += w.middleCols(k0, nk) * panel;
+						}
+					}
+				}
+			}
+		});
+	}
+
+	void Conv2d::backward_implicit(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		int icg = ic / groups;
+		int ocg = oc / groups;
+		int K = icg * kh * kw;
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			float* scratch = im_col.data() + (size_t)panel_rows * panel_cols * t;
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+			for (int n = n0; n < n1; n++) {
+				db += delta.block(oc * n, 0, oc, ohw).rowwise().sum();
+				for (int g = 0; g < groups; g++) {
+					const float* im = prev_out.data() + ihw * (icg * g + ic * n);
+					float* pd = prev_delta.data() + ihw * (icg * g + ic * n);
+					auto w = kernel.middleRows(ocg * g, ocg);
+					auto dw = dk.middleRows(ocg * g, ocg);
+					for (int p0 = 0; p0 < ohw; p0 += panel_cols) {
+						int np = std::min(panel_cols, ohw - p0);
+						auto d = delta.block(ocg * g + oc * n, p0, ocg, np);
+						for (int k0 = 0; k0 < K; k0 += panel_rows) {
+							int nk = std::min(panel_rows, K - k0);
+							Map<MatXf> panel(scratch, nk, np);
+							im2col_panel(im, icg, ih, iw, kh, stride, pad, dilation, k0, nk, p0, np, scratch);
+							dw.middleCols(k0, nk).noalias() += d * panel.transpose();
+							if (!is_first) {
+								panel.noalias() = w.middleCols(k0, nk).transpose() * d;
+								col2im_panel(scratch, icg, ih, iw, kh, stride, pad, dilation, k0, nk, p0, np, pd);
+							}
+						}
+					}
+				}
+			}
+		});
+		add_partial_grads();
+	}
+
+	// The samples are split across threads, each with its own tile of im_col.
+	void Conv2d::forward_tiled(const MapXf& prev_out)
+	{
+		int icg = ic / groups;
+		int ocg = oc / groups;
+		int K = icg * kh * kw;
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			float* scratch = im_col.data() + (size_t)K * tile_cols * t;
+			for (int n = n0; n < n1; n++) {
+				for (int g = 0; g < groups; g++) {
+					const float* im = prev_out.data() + ihw * (icg * g + ic * n);
+					for (int p0 = 0; p0 < ohw; p0 += tile_cols) {
+						int np = std::min(tile_cols, ohw - p0);
+						Map<MatXf> cols(scratch, K, np);
+						im2col_panel(im, icg, ih, iw, kh, stride, pad, dilation, 0, K, p0, np, scratch);
+						auto out = output.block(ocg * g + oc * n, p0, ocg, np);
+						out.noalias() = kernel.middleRows(ocg * g, ocg) * cols;
+						out.colwise() += bias.segment(ocg * g, ocg);
+					}
+				}
+			}
+		});
+	}
+
+	void Conv2d::backward_tiled(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		int icg = ic / groups;
+		int ocg = oc / groups;
+		int K = icg * kh * kw;
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			float* scratch = im_col.data() + (size_t)K * tile_cols * t;
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+			for (int n = n0; n < n1; n++) {
+				db += delta.block(oc * n, 0, oc, ohw).rowwise().sum();
+				for (int g = 0; g < groups; g++) {
+					const float* im = prev_out.data() + ihw * (icg * g + ic * n);
+					float* pd = is_first ? nullptr : prev_delta.data() + ihw * (icg * g + ic * n);
+					for (int p0 = 0; p0 < ohw; p0 += tile_cols) {
+						int np = std::min(tile_cols, ohw - p0);
+						Map<MatXf> cols(scratch, K, np);
+						auto d = delta.block(ocg * g + oc * n, p0, ocg, np);
+						im2col_panel(im, icg, ih, iw, kh, stride, pad, dilation, 0, K, p0, np, scratch);
+						dk.middleRows(ocg * g, ocg).noalias() += d * cols.transpose();
+						if (pd != nullptr) {
+							// the tile's scratch is reused for its input gradient; overlapping halos add up
+							cols.noalias() = kernel.middleRows(ocg * g, ocg).transpose() * d;
+							col2im_panel(scratch, icg, ih, iw, kh, stride, pad, dilation, 0, K, p0, np, pd);
+						}
+					}
+				}
+			}
+		});
+		add_partial_grads();
+	}
 
+	void Conv2d::update_winograd_filters()
+	{
+		// the transformed filters are cached until the kernel changes (e.g. update_weight, load)
+		if (wino_kernel.size() == kernel.size() && wino_kernel == kernel) return;
+
+		winograd_filter_transform(kernel, oc, ic, wino, false, wino_U);
+		if (!inference_only) winograd_filter_transform(kernel, oc, ic, wino, true, wino_Ub);
+		wino_kernel = kernel;
+	}
+
+	// The samples are split across threads, each with its own rows of wino_V and wino_M.
+	void Conv2d::forward_winograd(const MapXf& prev_out)
+	{
+		update_winograd_filters();
+		size_t scratch = wino_V.size() / n_threads();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			if (n0 == n1) return;
+			for (int n = n0; n < n1; n++) {
+				output.block(oc * n, 0, oc, ohw).colwise() = bias;
+			}
+			winograd_conv(prev_out.data() + (size_t)ihw * ic * n0, n1 - n0, ic, ih, iw, pad, wino_U, oc, oh, ow, wino,
+				wino_batch, wino_V.data() + scratch * t, wino_M.data() + scratch * t, output.data() + (size_t)ohw * oc * n0);
+		});
+	}
+
+	void Conv2d::backward_winograd(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		backward_im2col(prev_out, prev_delta, false);
+
+		// dx is a full convolution of delta with the rotated kernel
 		if (!is_first) {
-			for (int n = 0; n < batch; n++) {
-				float* begin = prev_delta.data() + ic * ihw * n;
-				im_col = kernel.transpose() * delta.block(oc * n, 0, oc, ohw);
-				col2im(im_col.data(), ic, ih, iw, kh, 1, pad, begin);
+			update_winograd_filters();
+			size_t scratch = wino_V.size() / n_threads();
+			parallel_for(batch, [&](int n0, int n1, int t) {
+				if (n0 == n1) return;
+				winograd_conv(delta.data() + (size_t)ohw * oc * n0, n1 - n0, oc, oh, ow, kh - 1 - pad, wino_Ub, ic, ih, iw, wino,
+					wino_batch, wino_V.data() + scratch * t, wino_M.data() + scratch * t, prev_delta.data() + (size_t)ihw * ic * n0);
+			});
+		}
+	}
+
+	// Per sample, the 2d FFT costs about 5 N log2(N) flops on the N-point grid (half of it for
+	// a real input) and every channel pair adds a complex multiply-add per frequency.
+	bool Conv2d::fft_preferred(int nh, int nw) const
+	{
+		double F = (double)nh * (nw / 2 + 1);
+		double transforms = (ic + oc) * 2.5 * nh * nw * std::log2((double)nh * nw);
+		double fft_flops = transforms + 8.0 * oc * ic * F;
+		double gemm_flops = 2.0 * oc * ic * kh * kw * ohw;
+		size_t spectra_bytes = sizeof(cpxf) * (size_t)F * (2 * oc * ic + ic + oc);
+		return spectra_bytes <= max_workspace && fft_flops * CONV_FFT_THRESHOLD < gemm_flops;
+	}
+
+	void Conv2d::update_fft_filters()
+	{
+		// the filter spectra are cached until the kernel changes (e.g. update_weight, load);
+		// they are conjugated so that a product with an input spectrum is a cross-correlation
+		if (fft_kernel.size() == kernel.size() && fft_kernel == kernel) return;
+
+		int kk = kh * kw;
+		parallel_for(oc, [&](int o0, int o1, int t) {
+			for (int o = o0; o < o1; o++) {
+				for (int c = 0; c < ic; c++) {
+					cpxf* w = fft_W.row(ic * o + c).data();
+					fft[t].forward(kernel.data() + kernel.cols() * o + kk * c, kh, kw, kw, 0, 0, w);
+				}
 			}
+		});
+		fft_W = fft_W.conjugate();
+		fft_kernel = kernel;
+	}
+
+	// The samples are split across threads, each with its own transforms and spectra.
+	void Conv2d::forward_fft(const MapXf& prev_out)
+	{
+		update_fft_filters();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			auto X = fft_X.middleRows(ic * t, ic);
+			auto Y = fft_Y.middleRows(oc * t, oc);
+			for (int n = n0; n < n1; n++) {
+				for (int c = 0; c < ic; c++) {
+					fft[t].forward(prev_out.data() + ihw * (c + ic * n), ih, iw, iw, pad, pad, X.row(c).data());
+				}
+				for (int o = 0; o < oc; o++) {
+					Y.row(o).setZero();
+					for (int c = 0; c < ic; c++) {
+						Y.row(o) += fft_W.row(ic * o + c).cwiseProduct(X.row(c));
+					}
+					float* out = output.data() + ohw * (o + oc * n);
+					fft[t].inverse(Y.row(o).data(), 0, oh, 0, ow, out, ow, false);
+					Map<RowVecXf>(out, ohw).array() += bias[o];
+				}
+			}
+		});
+	}
+
+	// dx is the full convolution of delta with the kernel and dw the correlation of the input
+	// with delta; both are products of spectra, and dw is summed over the samples of a thread
+	// before its inverse transforms.
+	void Conv2d::backward_fft(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		update_fft_filters();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			auto X = fft_X.middleRows(ic * t, ic);
+			auto Y = fft_Y.middleRows(oc * t, oc);
+			auto dW = fft_dW.middleRows(oc * ic * t, oc * ic);
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+			if (n0 == n1) return;
+
+			dW.setZero();
+			for (int n = n0; n < n1; n++) {
+				db += delta.block(oc * n, 0, oc, ohw).rowwise().sum();
+				for (int c = 0; c < ic; c++) {
+					fft[t].forward(prev_out.data() + ihw * (c + ic * n), ih, iw, iw, pad, pad, X.row(c).data());
+				}
+				for (int o = 0; o < oc; o++) {
+					fft[t].forward(delta.data() + ohw * (o + oc * n), oh, ow, ow, 0, 0, Y.row(o).data());
+					for (int c = 0; c < ic; c++) {
+						dW.row(ic * o + c) += X.row(c).cwiseProduct(Y.row(o).conjugate());
+					}
+				}
+
+				if (!is_first) {
+					// the input spectra are no longer needed and hold the input gradient's
+					for (int c = 0; c < ic; c++) {
+						X.row(c).setZero();
+						for (int o = 0; o < oc; o++) {
+							X.row(c) += Y.row(o).cwiseProduct(fft_W.row(ic * o + c).conjugate());
+						}
+						float* pd = prev_delta.data() + ihw * (c + ic * n);
+						fft[t].inverse(X.row(c).data(), pad, ih, pad, iw, pd, iw, true);
+					}
+				}
+			}
+
+			int kk = kh * kw;
+			for (int o = 0; o < oc; o++) {
+				for (int c = 0; c < ic; c++) {
+					float* dw = dk.data() + dk.cols() * o + kk * c;
+					fft[t].inverse(dW.row(ic * o + c).data(), 0, kh, 0, kw, dw, kw, true);
+				}
+			}
+		});
+		add_partial_grads();
+	}
+
+	// Output channels are split across threads, in whole groups since the channels of a group
+	// share an input (and input gradient) plane. Each channel sums its weight gradient over the
+	// batch on its own, in the same order as on one thread.
+	void Conv2d::forward_depthwise(const MapXf& prev_out)
+	{
+		typedef Map<const RowVecXf, 0, InnerStride<>> StridedRow;
+		int mult = oc / groups;
+		parallel_for(oc, [&](int o0, int o1, int t) {
+			for (int o = o0; o < o1; o++) {
+				for (int n = 0; n < batch; n++) {
+					const float* im = prev_out.data() + ihw * (o / mult + ic * n);
+					float* out = output.data() + ohw * (o + oc * n);
+					std::fill(out, out + ohw, bias[o]);
+					for (int y = 0; y < kh; y++) {
+						int i_lo, i_hi;
+						im2col_valid_range(ih, oh, stride, y * dilation - pad, i_lo, i_hi);
+						for (int x = 0; x < kw; x++) {
+							int j_lo, j_hi;
+							im2col_valid_range(iw, ow, stride, x * dilation - pad, j_lo, j_hi);
+							float w = kernel(o, y * kw + x);
+							for (int i = i_lo; i < i_hi; i++) {
+								const float* in_row = im + iw * (i * stride + y * dilation - pad) + x * dilation - pad;
+								Map<RowVecXf>(out + ow * i + j_lo, j_hi - j_lo) +=
+									w * StridedRow(in_row + j_lo * stride, j_hi - j_lo, InnerStride<>(stride));
+							}
+						}
+					}
+				}
+			}
+		}, mult);
+	}
+
+	void Conv2d::backward_depthwise(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		typedef Map<const RowVecXf, 0, InnerStride<>> StridedRow;
+		int mult = oc / groups;
+		parallel_for(oc, [&](int o0, int o1, int t) {
+			for (int o = o0; o < o1; o++) {
+				for (int n = 0; n < batch; n++) {
+					const float* im = prev_out.data() + ihw * (o / mult + ic * n);
+					float* pd = is_first ? nullptr : prev_delta.data() + ihw * (o / mult + ic * n);
+					const float* d = delta.data() + ohw * (o + oc * n);
+					dbias[o] += std::accumulate(d, d + ohw, 0.f);
+					for (int y = 0; y < kh; y++) {
+						int i_lo, i_hi;
+						im2col_valid_range(ih, oh, stride, y * dilation - pad, i_lo, i_hi);
+						for (int x = 0; x < kw; x++) {
+							int j_lo, j_hi;
+							im2col_valid_range(iw, ow, stride, x * dilation - pad, j_lo, j_hi);
+							float w = kernel(o, y * kw + x);
+							float dw = 0.f;
+							for (int i = i_lo; i < i_hi; i++) {
+								int offset = iw * (i * stride + y * dilation - pad) + x * dilation - pad + j_lo * stride;
+								Map<const RowVecXf> d_row(d + ow * i + j_lo, j_hi - j_lo);
+								dw += d_row.dot(StridedRow(im + offset, j_hi - j_lo, InnerStride<>(stride)));
+								if (pd != nullptr) {
+									Map<RowVecXf, 0, InnerStride<>>(pd + offset, j_hi - j_lo, InnerStride<>(stride)) += w * d_row;
+								}
+							}
+							dkernel(o, y * kw + x) += dw;
+						}
+					}
+				}
+			}
+		}, mult);
+	}
+
+	// Returns the (nb * ohw) x (groups * K) unfolded input of samples [n0, n0 + nb), in the
+	// scratch of thread t. A pointwise convolution reads the channels-last input as it is.
+	const float* Conv2d::unfold_nhwc(const MapXf& prev_out, int n0, int nb, int t)
+	{
+		if (kh == 1 && kw == 1 && stride == 1 && pad == 0) {
+			return prev_out.data() + (size_t)ihw * ic * n0;
 		}
+
+		int row = ic * kh * kw;
+		bool cached = n0 / sub_batch < cached_chunks;
+		float* cols = cached ? col_cache.data() + (size_t)row * ohw * n0 : im_col.data() + (size_t)row * ohw * sub_batch * t;
+
+		if (cached && cache_valid) return cols;
+
+		for (int s = 0; s < nb; s++) {
+			const float* im = prev_out.data() + (size_t)ihw * ic * (n0 + s);
+			im2col_nhwc(im, ic, ih, iw, kh, stride, pad, dilation, groups, cols + (size_t)row * ohw * s);
+		}
+		return cols;
+	}
+
+	void Conv2d::forward_nhwc(const MapXf& prev_out, bool is_training)
+	{
+		int K = (ic / groups) * kh * kw;
+		int ocg = oc / groups;
+		int n_chunks = (batch + sub_batch - 1) / sub_batch;
+		cache_valid = false;
+		parallel_for(n_chunks, [&](int c0, int c1, int t) {
+			for (int n0 = sub_batch * c0; n0 < std::min(batch, sub_batch * c1); n0 += sub_batch) {
+				int nb = std::min(sub_batch, batch - n0);
+				Map<const MatXf> cols(unfold_nhwc(prev_out, n0, nb, t), nb * ohw, groups * K);
+				auto out = output.middleRows(ohw * n0, ohw * nb);
+				for (int g = 0; g < groups; g++) {
+					out.middleCols(ocg * g, ocg).noalias() = cols.middleCols(K * g, K) * kernel.middleRows(ocg * g, ocg).transpose();
+				}
+				out.rowwise() += bias.transpose();
+			}
+		});
+		cache_valid = cached_chunks > 0 && is_training;
+	}
+
+	void Conv2d::backward_nhwc(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		int icg = ic / groups;
+		int K = icg * kh * kw;
+		int ocg = oc / groups;
+		bool pointwise = kh == 1 && kw == 1 && stride == 1 && pad == 0;
+		int n_chunks = (batch + sub_batch - 1) / sub_batch;
+		parallel_for(n_chunks, [&](int c0, int c1, int t) {
+			int first = sub_batch * ohw * t;
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+
+			for (int n0 = sub_batch * c0; n0 < std::min(batch, sub_batch * c1); n0 += sub_batch) {
+				int nb = std::min(sub_batch, batch - n0);
+				auto d = delta.middleRows(ohw * n0, ohw * nb);
+				db += d.colwise().sum().transpose();
+
+				Map<const MatXf> cols(unfold_nhwc(prev_out, n0, nb, t), nb * ohw, groups * K);
+				for (int g = 0; g < groups; g++) {
+					dk.middleRows(ocg * g, ocg).noalias() += d.middleCols(ocg * g, ocg).transpose() * cols.middleCols(K * g, K);
+				}
+
+				if (is_first) continue;
+
+				if (pointwise) {
+					// the gradient of the unfolded input is the gradient of the input
+					auto pd = prev_delta.middleRows(ihw * n0, ihw * nb);
+					for (int g = 0; g < groups; g++) {
+						pd.middleCols(K * g, K).noalias() += d.middleCols(ocg * g, ocg) * kernel.middleRows(ocg * g, ocg);
+					}
+					continue;
+				}
+
+				for (int g = 0; g < groups; g++) {
+					col_buf.block(first, K * g, ohw * nb, K).noalias() = d.middleCols(ocg * g, ocg) * kernel.middleRows(ocg * g, ocg);
+				}
+				for (int s = 0; s < nb; s++) {
+					float* pd = prev_delta.data() + (size_t)ihw * ic * (n0 + s);
+					col2im_nhwc(col_buf.data() + (size_t)groups * K * (first + ohw * s), ic, ih, iw, kh, stride, pad, dilation, groups, pd);
+				}
+			}
+		});
+		add_partial_grads();
+	}
+
+	// Channels-last depthwise convolution: every tap scales whole channel vectors,
+	// over a row of output pixels at once. The samples are split across threads.
+	void Conv2d::forward_depthwise_nhwc(const MapXf& prev_out)
+	{
+		typedef Map<const MatXf, 0, OuterStride<>> Pixels;
+		im_col = kernel.transpose();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
+				output.middleRows(ohw * n, ohw).rowwise() = bias.transpose();
+				for (int i = 0; i < oh; i++) {
+					for (int y = 0; y < kh; y++) {
+						int ii = i * stride + y * dilation - pad;
+						if (ii < 0 || ii >= ih) continue;
+						for (int x = 0; x < kw; x++) {
+							int j_lo, j_hi;
+							im2col_valid_range(iw, ow, stride, x * dilation - pad, j_lo, j_hi);
+							if (j_lo == j_hi) continue;
+							const float* in = prev_out.data() + ic * (ihw * n + iw * ii + j_lo * stride + x * dilation - pad);
+							Pixels src(in, j_hi - j_lo, ic, OuterStride<>(ic * stride));
+							output.block(ohw * n + ow * i + j_lo, 0, j_hi - j_lo, oc).array() +=
+								src.array().rowwise() * im_col.row(y * kw + x).array();
+						}
+					}
+				}
+			}
+		});
+	}
+
+	void Conv2d::backward_depthwise_nhwc(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		typedef Map<const MatXf, 0, OuterStride<>> Pixels;
+		int kk = kh * kw;
+		im_col = kernel.transpose();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			auto dw = col_buf.middleRows(kk * t, kk);
+			MatXf& dk = partial_dkernel(t);
+			VecXf& db = partial_dbias(t);
+			dw.setZero();
+			for (int n = n0; n < n1; n++) {
+				db += delta.middleRows(ohw * n, ohw).colwise().sum().transpose();
+				for (int i = 0; i < oh; i++) {
+					for (int y = 0; y < kh; y++) {
+						int ii = i * stride + y * dilation - pad;
+						if (ii < 0 || ii >= ih) continue;
+						for (int x = 0; x < kw; x++) {
+							int j_lo, j_hi;
+							im2col_valid_range(iw, ow, stride, x * dilation - pad, j_lo, j_hi);
+							if (j_lo == j_hi) continue;
+							int offset = ic * (ihw * n + iw * ii + j_lo * stride + x * dilation - pad);
+							auto d = delta.block(ohw * n + ow * i + j_lo, 0, j_hi - j_lo, oc);
+							Pixels src(prev_out.data() + offset, j_hi - j_lo, ic, OuterStride<>(ic * stride));
+							dw.row(y * kw + x) += (d.array() * src.array()).colwise().sum().matrix();
+							if (!is_first) {
+								Map<MatXf, 0, OuterStride<>> pd(prev_delta.data() + offset, j_hi - j_lo, ic, OuterStride<>(ic * stride));
+								pd.array() += d.array().rowwise() * im_col.row(y * kw + x).array();
+							}
+						}
+					}
+				}
+			}
+			dk += dw.transpose();
+		});
+		add_partial_grads();
 	}
 
 	void Conv2d::update_weight(float lr, float decay)
@@ -126,10 +1007,83 @@ namespace simple_nn
 
 	void Conv2d::zero_grad()
 	{
-		delta.setZero();
 		dkernel.setZero();
 		dbias.setZero();
 	}
 
 	vector<int> Conv2d::output_shape() { return { batch, oc, oh, ow }; }
+
+	Layer* Conv2d::clone() const { return new Conv2d(*this); }
+
+	vector<Param> Conv2d::params()
+	{
+		return { { kernel.data(), dkernel.data(), (int)kernel.size() }, { bias.data(), dbias.data(), (int)bias.size() } };
+	}
+
+	// The unfolded inputs of the cached sub-batches are kept for backward; the other scratch is
+	// filled anew by every pass.
+	vector<Buffer> Conv2d::buffers()
+	{
+		return {
+			make_buffer(im_col, Lifetime::CALL),
+			make_buffer(col_buf, Lifetime::CALL),
+			make_buffer(col_cache, Lifetime::STEP),
+			make_buffer(wino_V, Lifetime::CALL),
+			make_buffer(wino_M, Lifetime::CALL)
+		};
+	}
+
+	// Returns src, a kernel in the row order of layout from, in that of layout to. Saved models
+	// hold the NCHW order.
+	MatXf Conv2d::reorder_kernel(const MatXf& src, Layout from, Layout to) const
+	{
+		if (from == to) return src;
+
+		int icg = ic / groups;
+		MatXf dst(src.rows(), src.cols());
+		for (int c = 0; c < icg; c++) {
+			for (int y = 0; y < kh; y++) {
+				for (int x = 0; x < kw; x++) {
+					int nchw = kw * (kh * c + y) + x;
+					int nhwc = icg * (kw * y + x) + c;
+					if (from == Layout::NCHW) dst.col(nhwc) = src.col(nchw);
+					else dst.col(nchw) = src.col(nhwc);
+				}
+			}
+		}
+		return dst;
+	}
+
+	// Conv2d with the kernel size, stride and padding fixed at compile time, which unrolls
+	// the window loops of im2col and col2im. Other configurations run the generic paths.
+	template<int K, int S, int P>
+	class Conv2dK : public Conv2d
+	{
+	public:
+		Conv2dK(int in_channels, int out_channels, string option, int groups = 1) :
+			Conv2d(in_channels, out_channels, K, P, option, S, 1, groups) {}
+		Conv2dK(const Conv2d& conv) : Conv2d(conv) {}
+		Layer* specialize() override { return nullptr; }
+	protected:
+		void im2col_sample(const float* im, int channels, float* cols, int ld) override
+		{
+			im2col_k<K, S, P>(im, channels, ih, iw, cols, ld);
+		}
+
+		void col2im_sample(const float* cols, int channels, float* im, int ld) override
+		{
+			col2im_k<K, S, P>(cols, channels, ih, iw, im, ld);
+		}
+	};
+
+	Layer* Conv2d::specialize()
+	{
+		if (layout != Layout::NCHW || algo != ConvAlgo::IM2COL || dilation != 1 || kh != kw) return nullptr;
+
+		if (kh == 5 && stride == 1 && pad == 2) return new Conv2dK<5, 1, 2>(*this);
+		if (kh == 5 && stride == 1 && pad == 0) return new Conv2dK<5, 1, 0>(*this);
+		if (kh == 3 && stride == 1 && pad == 1) return new Conv2dK<3, 1, 1>(*this);
+		if (kh == 3 && stride == 2 && pad == 1) return new Conv2dK<3, 2, 1>(*this);
+		return nullptr;
+	}
 }
\ No newline at end of file
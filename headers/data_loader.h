@@ -12,6 +12,7 @@ namespace simple_nn
 		int h;
 		int w;
 		int chhw;
+		bool shuffled;
 		MatXf X;
 		VecXi Y;
 		vector<vector<int>> batch_indices;
@@ -25,12 +26,14 @@ namespace simple_nn
 		vector<int> input_shape() const;
 		MatXf get_x(int i) const;
 		VecXi get_y(int i) const;
+		void shard(int rank, int world_size, unsigned seed);
 	private:
 		void generate_batch_indices(bool shuffle);
+		void generate_batch_indices(bool shuffle, unsigned seed);
 	};
 
 	DataLoader::DataLoader() :
-		n_batch(0), batch(0), ch(0), h(0), w(0), chhw(0) {}
+		n_batch(0), batch(0), ch(0), h(0), w(0), chhw(0), shuffled(false) {}
 
 	DataLoader::DataLoader(
 		MatXf& X,
@@ -48,7 +51,8 @@ namespace simple_nn
 		ch(channels),
 		h(height),
 		w(width),
-		chhw(channels * height * width)
+		chhw(channels * height * width),
+		shuffled(shuffle)
 	{
 		n_batch = (int)this->X.rows() / ch / batch;
 		generate_batch_indices(shuffle);
@@ -64,6 +68,7 @@ namespace simple_nn
 		h = height;
 		w = width;
 		chhw = ch * h * w;
+		shuffled = shuffle;
 		n_batch = (int)this->X.rows() / ch / batch;
 		generate_batch_indices(shuffle);
 	}
@@ -73,12 +78,17 @@ namespace simple_nn
 	vector<int> DataLoader::input_shape() const { return { batch, ch, h, w }; }
 
 	void DataLoader::generate_batch_indices(bool shuffle)
+	{
+		unsigned seed = (unsigned)std::chrono::system_clock::now().time_since_epoch().count();
+		generate_batch_indices(shuffle, seed);
+	}
+
+	void DataLoader::generate_batch_indices(bool shuffle, unsigned seed)
 	{
 		vector<int> rand_num(batch * n_batch);
 		std::iota(rand_num.begin(), rand_num.end(), 0);
 
 		if (shuffle) {
-			unsigned seed = (unsigned)std::chrono::system_clock::now().time_since_epoch().count();
 			std::shuffle(rand_num.begin(), rand_num.end(), std::default_random_engine(seed));
 		}
 
@@ -110,4 +120,17 @@ namespace simple_nn
 		}
 		return batch_y;
 	}
+
+	// For distributed training: every process draws the same order of the samples from seed (if
+	// the loader shuffles), then keeps batches rank, rank + world_size, ..., the same number on
+	// every process, so the processes train on disjoint parts of the data in step.
+	void DataLoader::shard(int rank, int world_size, unsigned seed)
+	{
+		generate_batch_indices(shuffled, seed);
+		n_batch /= world_size;
+		for (int i = 0; i < n_batch; i++) {
+			batch_indices[i] = batch_indices[(size_t)i * world_size + rank];
+		}
+		batch_indices.resize(n_batch);
+	}
 }
\ No newline at end of file
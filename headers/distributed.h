@@ -0,0 +1,433 @@
+#pragma once
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "layer.h"
+
+namespace simple_nn
+{
+	// floats per gradient bucket (1 MB): large enough to amortize the latency of a ring pass,
+	// small enough that the first buckets leave while backward is still running
+	const int DIST_BUCKET_FLOATS = 1 << 18;
+
+	// port of the rendezvous when --master_addr has none
+	const int DIST_DEFAULT_PORT = 29500;
+
+	// A group of training processes connected in a ring over TCP, one process per rank.
+	// init() meets at master_addr ("host[:port]"), where rank 0 listens: every rank reports the port
+	// of its ring socket, rank 0 sends back the table of all of them and a seed for the data
+	// order, and each rank connects to rank + 1 and accepts rank - 1. all_reduce runs the ring
+	// algorithm: world_size - 1 steps of reduce-scatter, then as many of all-gather, each sending
+	// one chunk of 1 / world_size of the array while receiving another. Each chunk is summed
+	// along the ring by a single rank and copied to the others, so every rank gets the same bits.
+	class ProcessGroup
+	{
+	private:
+		int rank_;
+		int world;
+		unsigned seed_;
+		int left;	// connection from rank - 1
+		int right;	// connection to rank + 1
+		vector<float> recv_buf;
+	public:
+		ProcessGroup();
+		~ProcessGroup();
+		void init(int rank, int world_size, string master_addr);
+		int rank() const;
+		int size() const;
+		unsigned seed() const;
+		void all_reduce(float* data, int n);
+		// Copies data of rank 0 to the other ranks.
+		void broadcast(float* data, int n);
+	private:
+		void exchange(const float* send_data, int n_send, float* recv_data, int n_recv);
+		static int listen_on(int port, int& bound_port);
+		static int connect_to(in_addr_t ip, int port, int timeout_sec);
+		static void send_all(int fd, const void* data, size_t bytes);
+		static void recv_all(int fd, void* data, size_t bytes);
+		static void fail(string msg);
+	};
+
+	ProcessGroup::ProcessGroup() : rank_(0), world(1), seed_(0), left(-1), right(-1) {}
+
+	ProcessGroup::~ProcessGroup()
+	{
+		if (left >= 0) ::close(left);
+		if (right >= 0) ::close(right);
+	}
+
+	void ProcessGroup::init(int rank, int world_size, string master_addr)
+	{
+		rank_ = rank;
+		world = world_size;
+		seed_ = (unsigned)std::chrono::system_clock::now().time_since_epoch().count();
+		if (world == 1) return;
+
+		string host = master_addr;
+		int port = DIST_DEFAULT_PORT;
+		size_t colon = master_addr.rfind(':');
+		if (colon != string::npos) {
+			host = master_addr.substr(0, colon);
+			port = std::stoi(master_addr.substr(colon + 1));
+		}
+
+		addrinfo hints = {};
+		addrinfo* res = nullptr;
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (::getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || res == nullptr) {
+			fail("Cannot resolve the master address " + host + ".");
+		}
+		in_addr_t master_ip = ((sockaddr_in*)res->ai_addr)->sin_addr.s_addr;
+		::freeaddrinfo(res);
+
+		int ring_port = 0;
+		int ring_fd = listen_on(0, ring_port);
+
+		// (ip, port) of the ring socket of every rank, then the seed
+		vector<uint32_t> table(2 * world + 1);
+		if (rank_ == 0) {
+			int unused = 0;
+			int master_fd = listen_on(port, unused);
+			table[0] = master_ip;
+			table[1] = (uint32_t)ring_port;
+			vector<int> conns;
+			for (int i = 1; i < world; i++) {
+				sockaddr_in peer = {};
+				socklen_t len = sizeof(peer);
+				int fd = ::accept(master_fd, (sockaddr*)&peer, &len);
+				if (fd < 0) fail("Rendezvous failed (accept).");
+				int32_t msg[2];
+				recv_all(fd, msg, sizeof(msg));
+				if (msg[0] <= 0 || msg[0] >= world) fail("Rendezvous failed (invalid rank).");
+				table[2 * msg[0]] = peer.sin_addr.s_addr;
+				table[2 * msg[0] + 1] = (uint32_t)msg[1];
+				conns.push_back(fd);
+			}
+			table[2 * world] = seed_;
+			for (int fd : conns) {
+				send_all(fd, table.data(), table.size() * sizeof(uint32_t));
+				::close(fd);
+			}
+			::close(master_fd);
+		}
+		else {
+			int fd = connect_to(master_ip, port, 60);
+			int32_t msg[2] = { rank_, ring_port };
+			send_all(fd, msg, sizeof(msg));
+			recv_all(fd, table.data(), table.size() * sizeof(uint32_t));
+			::close(fd);
+			seed_ = table[2 * world];
+		}
+
+		// the listening socket queues the connection of rank - 1, so connecting first cannot block
+		int next = (rank_ + 1) % world;
+		right = connect_to(table[2 * next], (int)table[2 * next + 1], 60);
+		left = ::accept(ring_fd, nullptr, nullptr);
+		if (left < 0) fail("Rendezvous failed (ring accept).");
+		::close(ring_fd);
+
+		for (int fd : { left, right }) {
+			int one = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+	}
+
+	int ProcessGroup::rank() const { return rank_; }
+
+	int ProcessGroup::size() const { return world; }
+
+	// Shared by all ranks after init (rank 0's clock), e.g. to shuffle the data alike.
+	unsigned ProcessGroup::seed() const { return seed_; }
+
+	void ProcessGroup::all_reduce(float* data, int n)
+	{
+		if (world == 1) return;
+
+		auto begin = [&](int c) { return (int)((long long)n * c / world); };
+		auto len = [&](int c) { return begin(c + 1) - begin(c); };
+		auto mod = [&](int c) { return ((c % world) + world) % world; };
+		recv_buf.resize(len(world - 1) + 1);
+
+		// after step s, chunk rank - s - 1 holds the sum of s + 2 ranks; rank ends with chunk rank + 1
+		for (int s = 0; s < world - 1; s++) {
+			int sc = mod(rank_ - s);
+			int rc = mod(rank_ - s - 1);
+			exchange(data + begin(sc), len(sc), recv_buf.data(), len(rc));
+			Map<VecXf>(data + begin(rc), len(rc)) += Map<const VecXf>(recv_buf.data(), len(rc));
+		}
+		for (int s = 0; s < world - 1; s++) {
+			int sc = mod(rank_ + 1 - s);
+			int rc = mod(rank_ - s);
+			exchange(data + begin(sc), len(sc), data + begin(rc), len(rc));
+		}
+	}
+
+	void ProcessGroup::broadcast(float* data, int n)
+	{
+		if (rank_ != 0) std::fill(data, data + n, 0.f);
+		all_reduce(data, n);
+	}
+
+	// Sends to rank + 1 while receiving from rank - 1. Both sides of the ring send at once, so
+	// neither may block on a full socket before draining its input.
+	void ProcessGroup::exchange(const float* send_data, int n_send, float* recv_data, int n_recv)
+	{
+		const char* out = (const char*)send_data;
+		char* in = (char*)recv_data;
+		size_t to_send = sizeof(float) * n_send;
+		size_t to_recv = sizeof(float) * n_recv;
+		while (to_send > 0 || to_recv > 0) {
+			pollfd fds[2];
+			int n_fds = 0;
+			if (to_send > 0) fds[n_fds++] = { right, POLLOUT, 0 };
+			if (to_recv > 0) fds[n_fds++] = { left, POLLIN, 0 };
+			if (::poll(fds, n_fds, -1) < 0) {
+				if (errno == EINTR) continue;
+				fail("All-reduce failed (poll).");
+			}
+			for (int i = 0; i < n_fds; i++) {
+				if (fds[i].revents == 0) continue;
+				if (fds[i].fd == right) {
+					ssize_t r = ::send(right, out, to_send, MSG_NOSIGNAL);
+					if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) fail("All-reduce failed (send).");
+					if (r > 0) {
+						out += r;
+						to_send -= r;
+					}
+				}
+				else {
+					ssize_t r = ::recv(left, in, to_recv, 0);
+					if (r == 0) fail("All-reduce failed (rank " + to_string((rank_ + world - 1) % world) + " closed the connection).");
+					if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) fail("All-reduce failed (recv).");
+					if (r > 0) {
+						in += r;
+						to_recv -= r;
+					}
+				}
+			}
+		}
+	}
+
+	// A listening socket on port (0 picks a free one, returned in bound_port).
+	int ProcessGroup::listen_on(int port, int& bound_port)
+	{
+		int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((uint16_t)port);
+		if (fd < 0 || ::bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(fd, 64) < 0) {
+			fail("Cannot listen on port " + to_string(port) + ".");
+		}
+		socklen_t len = sizeof(addr);
+		::getsockname(fd, (sockaddr*)&addr, &len);
+		bound_port = ntohs(addr.sin_port);
+		return fd;
+	}
+
+	// Retries until the peer listens (processes may start in any order) or timeout_sec passes.
+	int ProcessGroup::connect_to(in_addr_t ip, int port, int timeout_sec)
+	{
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = ip;
+		addr.sin_port = htons((uint16_t)port);
+
+		system_clock::time_point deadline = system_clock::now() + seconds(timeout_sec);
+		while (true) {
+			int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+			if (fd >= 0 && ::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+			if (fd >= 0) ::close(fd);
+			if (system_clock::now() > deadline) {
+				char buf[INET_ADDRSTRLEN];
+				::inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf));
+				fail("Cannot connect to " + string(buf) + ":" + to_string(port) + ".");
+			}
+			std::this_thread::sleep_for(milliseconds(100));
+		}
+	}
+
+	void ProcessGroup::send_all(int fd, const void* data, size_t bytes)
+	{
+		const char* p = (const char*)data;
+		while (bytes > 0) {
+			ssize_t r = ::send(fd, p, bytes, MSG_NOSIGNAL);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) fail("Rendezvous failed (send).");
+			p += r;
+			bytes -= r;
+		}
+	}
+
+	void ProcessGroup::recv_all(int fd, void* data, size_t bytes)
+	{
+		char* p = (char*)data;
+		while (bytes > 0) {
+			ssize_t r = ::recv(fd, p, bytes, 0);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) fail("Rendezvous failed (recv).");
+			p += r;
+			bytes -= r;
+		}
+	}
+
+	void ProcessGroup::fail(string msg)
+	{
+		cout << msg << endl;
+		exit(1);
+	}
+
+	// Averages the gradients of a model over a ProcessGroup between backward and update_weight.
+	// Parameters go into buckets of about DIST_BUCKET_FLOATS in the order backward produces them
+	// (last layer first); once backward has passed the first layer of a bucket, it is copied out
+	// and handed to a communication thread, which all-reduces it while backward goes on with the
+	// layers before. Buckets are reduced in the same order on every rank. State without a
+	// gradient (BatchNorm's moving statistics) is averaged as well, so the ranks stay identical.
+	class GradientSync
+	{
+	private:
+		struct Bucket
+		{
+			int first_layer;
+			vector<Param> params;
+			vector<float> flat;
+		};
+		ProcessGroup* group;
+		vector<Bucket> buckets;
+		int next;		// first bucket not yet launched in this step
+		int finished;	// buckets reduced in this step
+		bool stop;
+		float wait_sec;
+		thread comm;
+		mutex m;
+		condition_variable cv;
+	public:
+		GradientSync();
+		~GradientSync();
+		void set(ProcessGroup* group, const vector<vector<Param>>& layer_params);
+		void layer_done(int l);
+		void wait();
+		// Time spent in wait(), i.e. communication not hidden behind backward, since the last call.
+		float take_wait_time();
+	private:
+		void run();
+	};
+
+	GradientSync::GradientSync() : group(nullptr), next(0), finished(0), stop(false), wait_sec(0.f) {}
+
+	GradientSync::~GradientSync()
+	{
+		{
+			lock_guard<mutex> lock(m);
+			stop = true;
+		}
+		cv.notify_all();
+		if (comm.joinable()) comm.join();
+	}
+
+	void GradientSync::set(ProcessGroup* group, const vector<vector<Param>>& layer_params)
+	{
+		this->group = group;
+		buckets.clear();
+		int floats = DIST_BUCKET_FLOATS;
+		for (int l = (int)layer_params.size() - 1; l >= 0; l--) {
+			for (const Param& p : layer_params[l]) {
+				if (floats >= DIST_BUCKET_FLOATS) {
+					buckets.push_back({});
+					floats = 0;
+				}
+				buckets.back().first_layer = l;
+				buckets.back().params.push_back(p);
+				floats += p.size;
+			}
+		}
+		for (Bucket& b : buckets) {
+			int size = 0;
+			for (const Param& p : b.params) size += p.size;
+			b.flat.resize(size);
+		}
+		if (!comm.joinable()) comm = thread(&GradientSync::run, this);
+	}
+
+	// Called by backward after layer l; launches the buckets that are complete.
+	void GradientSync::layer_done(int l)
+	{
+		while (next < (int)buckets.size() && buckets[next].first_layer >= l) {
+			Bucket& b = buckets[next];
+			float* dst = b.flat.data();
+			for (const Param& p : b.params) {
+				const float* src = p.grad != nullptr ? p.grad : p.value;
+				dst = std::copy(src, src + p.size, dst);
+			}
+			{
+				lock_guard<mutex> lock(m);
+				next++;
+			}
+			cv.notify_all();
+		}
+	}
+
+	void GradientSync::wait()
+	{
+		layer_done(0);
+		system_clock::time_point start = system_clock::now();
+		{
+			unique_lock<mutex> lock(m);
+			cv.wait(lock, [&] { return finished == (int)buckets.size(); });
+			next = 0;
+			finished = 0;
+		}
+		duration<float> sec = system_clock::now() - start;
+		wait_sec += sec.count();
+	}
+
+	float GradientSync::take_wait_time()
+	{
+		float sec = wait_sec;
+		wait_sec = 0.f;
+		return sec;
+	}
+
+	void GradientSync::run()
+	{
+		float scale = 1.f / group->size();
+		while (true) {
+			int b = 0;
+			{
+				unique_lock<mutex> lock(m);
+				cv.wait(lock, [&] { return stop || finished < next; });
+				if (stop) return;
+				b = finished;
+			}
+
+			Bucket& bucket = buckets[b];
+			group->all_reduce(bucket.flat.data(), (int)bucket.flat.size());
+			const float* src = bucket.flat.data();
+			for (const Param& p : bucket.params) {
+				float* dst = p.grad != nullptr ? p.grad : p.value;
+				Map<VecXf>(dst, p.size) = Map<const VecXf>(src, p.size) * scale;
+				src += p.size;
+			}
+
+			{
+				lock_guard<mutex> lock(m);
+				finished++;
+			}
+			cv.notify_all();
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,236 @@
+#pragma once
+#include <complex>
+#include "common.h"
+
+namespace simple_nn
+{
+	typedef std::complex<float> cpxf;
+	typedef Matrix<cpxf, Dynamic, Dynamic, RowMajor> MatXcf;
+
+	// std::complex multiplication goes through a NaN-aware library call unless built with -ffast-math
+	cpxf cmul(const cpxf& a, const cpxf& b)
+	{
+		return cpxf(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+	}
+
+	// Smallest n' >= n whose only prime factors are 2, 3 and 5.
+	int fft_good_size(int n)
+	{
+		for (int m = std::max(n, 1);; m++) {
+			int r = m;
+			for (int p : { 2, 3, 5 }) {
+				while (r % p == 0) r /= p;
+			}
+			if (r == 1) return m;
+		}
+	}
+
+	// Mixed-radix decimation-in-time FFT of a fixed size and direction
+	// (the recursive Cooley-Tukey scheme of KISS FFT, radix 4 and 2 first, then odd factors).
+	class FFTPlan
+	{
+	private:
+		int n;
+		bool inverse;
+		vector<int> factors;	// (radix, remaining length) pairs
+		vector<cpxf> twiddles;
+	public:
+		FFTPlan() : n(0), inverse(false) {}
+		FFTPlan(int n, bool inverse);
+		int size() const { return n; }
+		// out[k] = sum_j in[j * in_stride] * exp(-+2 pi i j k / n), unnormalized; in and out must not overlap
+		void transform(const cpxf* in, int in_stride, cpxf* out) const;
+	private:
+		void work(cpxf* out, const cpxf* in, int fstride, int in_stride, const int* f) const;
+		void butterfly2(cpxf* out, int fstride, int m) const;
+		void butterfly4(cpxf* out, int fstride, int m) const;
+		void butterfly_generic(cpxf* out, int fstride, int m, int p) const;
+	};
+
+	FFTPlan::FFTPlan(int n, bool inverse) : n(n), inverse(inverse)
+	{
+		const double pi = 3.14159265358979323846;
+		twiddles.resize(n);
+		for (int i = 0; i < n; i++) {
+			double phase = (inverse ? 2 : -2) * pi * i / n;
+			twiddles[i] = cpxf((float)std::cos(phase), (float)std::sin(phase));
+		}
+
+		int p = 4;
+		int r = n;
+		int floor_sqrt = (int)std::floor(std::sqrt((double)n));
+		do {
+			while (r % p) {
+				if (p == 4) p = 2;
+				else if (p == 2) p = 3;
+				else p += 2;
+				if (p > floor_sqrt) p = r;
+			}
+			r /= p;
+			factors.push_back(p);
+			factors.push_back(r);
+		} while (r > 1);
+	}
+
+	void FFTPlan::transform(const cpxf* in, int in_stride, cpxf* out) const
+	{
+		if (n == 1) {
+			out[0] = in[0];
+			return;
+		}
+		work(out, in, 1, in_stride, factors.data());
+	}
+
+	void FFTPlan::work(cpxf* out, const cpxf* in, int fstride, int in_stride, const int* f) const
+	{
+		int p = f[0];
+		int m = f[1];
+		cpxf* out_end = out + p * m;
+
+		if (m == 1) {
+			for (cpxf* o = out; o != out_end; o++, in += fstride * in_stride) *o = *in;
+		}
+		else {
+			// p sub-transforms of length m over every p-th input
+			for (cpxf* o = out; o != out_end; o += m, in += fstride * in_stride) {
+				work(o, in, fstride * p, in_stride, f + 2);
+			}
+		}
+
+		if (p == 2) butterfly2(out, fstride, m);
+		else if (p == 4) butterfly4(out, fstride, m);
+		else butterfly_generic(out, fstride, m, p);
+	}
+
+	void FFTPlan::butterfly2(cpxf* out, int fstride, int m) const
+	{
+		cpxf* out2 = out + m;
+		const cpxf* tw = twiddles.data();
+		for (int k = 0; k < m; k++) {
+			cpxf t = cmul(out2[k], tw[fstride * k]);
+			out2[k] = out[k] - t;
+			out[k] += t;
+		}
+	}
+
+	void FFTPlan::butterfly4(cpxf* out, int fstride, int m) const
+	{
+		const cpxf* tw = twiddles.data();
+		for (int k = 0; k < m; k++) {
+			cpxf* o = out + k;
+			cpxf s0 = cmul(o[m], tw[fstride * k]);
+			cpxf s1 = cmul(o[2 * m], tw[2 * fstride * k]);
+			cpxf s2 = cmul(o[3 * m], tw[3 * fstride * k]);
+			cpxf s5 = o[0] - s1;
+			cpxf s0_ = o[0] + s1;
+			cpxf s3 = s0 + s2;
+			cpxf s4 = s0 - s2;
+			o[2 * m] = s0_ - s3;
+			o[0] = s0_ + s3;
+			// s4 rotated by -i (forward) or +i (inverse)
+			if (inverse) {
+				o[m] = cpxf(s5.real() - s4.imag(), s5.imag() + s4.real());
+				o[3 * m] = cpxf(s5.real() + s4.imag(), s5.imag() - s4.real());
+			}
+			else {
+				o[m] = cpxf(s5.real() + s4.imag(), s5.imag() - s4.real());
+				o[3 * m] = cpxf(s5.real() - s4.imag(), s5.imag() + s4.real());
+			}
+		}
+	}
+
+	void FFTPlan::butterfly_generic(cpxf* out, int fstride, int m, int p) const
+	{
+		const cpxf* tw = twiddles.data();
+		vector<cpxf> scratch(p);
+		for (int u = 0; u < m; u++) {
+			for (int q = 0, k = u; q < p; q++, k += m) {
+				scratch[q] = out[k];
+			}
+			for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+				int twidx = 0;
+				cpxf sum = scratch[0];
+				for (int q = 1; q < p; q++) {
+					twidx += fstride * k;
+					if (twidx >= n) twidx -= n;
+					sum += cmul(scratch[q], tw[twidx]);
+				}
+				out[k] = sum;
+			}
+		}
+	}
+
+	// Real 2d transforms on an nh x nw grid. Spectra keep the nw / 2 + 1 non-redundant
+	// columns of each row (Hermitian symmetry), nh x (nw / 2 + 1) complex values in row-major order.
+	class FFT2d
+	{
+	private:
+		int nh;
+		int nw;
+		int nwc;
+		FFTPlan row_fwd;
+		FFTPlan row_inv;
+		FFTPlan col_fwd;
+		FFTPlan col_inv;
+		vector<cpxf> buf1;
+		vector<cpxf> buf2;
+	public:
+		FFT2d() : nh(0), nw(0), nwc(0) {}
+		FFT2d(int nh, int nw);
+		int spectrum_size() const { return nh * nwc; }
+		// spectrum of a rows x cols image (row stride ld) placed at (r0, c0) of an otherwise zero grid
+		void forward(const float* src, int rows, int cols, int ld, int r0, int c0, cpxf* spec);
+		// adds (or writes) the window [r0, r0 + rows) x [c0, c0 + cols) of the normalized
+		// inverse transform into dst (row stride ld); spec is used as scratch
+		void inverse(cpxf* spec, int r0, int rows, int c0, int cols, float* dst, int ld, bool accumulate);
+	};
+
+	FFT2d::FFT2d(int nh, int nw) :
+		nh(nh),
+		nw(nw),
+		nwc(nw / 2 + 1),
+		row_fwd(nw, false),
+		row_inv(nw, true),
+		col_fwd(nh, false),
+		col_inv(nh, true),
+		buf1(std::max(nh, nw)),
+		buf2(std::max(nh, nw)) {}
+
+	void FFT2d::forward(const float* src, int rows, int cols, int ld, int r0, int c0, cpxf* spec)
+	{
+		// rows of the grid outside [r0, r0 + rows) are zero and so is their spectrum
+		std::fill(spec, spec + nh * nwc, cpxf(0.f, 0.f));
+		for (int i = 0; i < rows; i++) {
+			std::fill(buf1.begin(), buf1.begin() + nw, cpxf(0.f, 0.f));
+			for (int j = 0; j < cols; j++) {
+				buf1[c0 + j] = cpxf(src[ld * i + j], 0.f);
+			}
+			row_fwd.transform(buf1.data(), 1, buf2.data());
+			std::copy(buf2.begin(), buf2.begin() + nwc, spec + nwc * (r0 + i));
+		}
+		for (int k = 0; k < nwc; k++) {
+			col_fwd.transform(spec + k, nwc, buf2.data());
+			for (int i = 0; i < nh; i++) spec[nwc * i + k] = buf2[i];
+		}
+	}
+
+	void FFT2d::inverse(cpxf* spec, int r0, int rows, int c0, int cols, float* dst, int ld, bool accumulate)
+	{
+		float scale = 1.f / ((float)nh * nw);
+		for (int k = 0; k < nwc; k++) {
+			col_inv.transform(spec + k, nwc, buf2.data());
+			for (int i = 0; i < nh; i++) spec[nwc * i + k] = buf2[i];
+		}
+		for (int i = 0; i < rows; i++) {
+			const cpxf* s = spec + nwc * (r0 + i);
+			std::copy(s, s + nwc, buf1.begin());
+			for (int k = nwc; k < nw; k++) buf1[k] = std::conj(s[nw - k]);
+			row_inv.transform(buf1.data(), 1, buf2.data());
+			float* d = dst + ld * i;
+			for (int j = 0; j < cols; j++) {
+				float v = buf2[c0 + j].real() * scale;
+				d[j] = accumulate ? d[j] + v : v;
+			}
+		}
+	}
+}
@@ -3,6 +3,8 @@
 
 namespace simple_nn
 {
+	// Features are flattened in the (channel, height, width) order in both layouts, so that the
+	// weights of the following Linear do not depend on the layout.
 	class Flatten : public Layer
 	{
 	private:
@@ -14,10 +16,10 @@ namespace simple_nn
 	public:
 		Flatten();
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
-		void zero_grad() override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		vector<int> output_shape() override;
+		Layer* clone() const override;
 	};
 
 	Flatten::Flatten() : Layer(LayerType::FLATTEN) {}
@@ -31,21 +33,38 @@ namespace simple_nn
 		width = input_shape[3];
 		out_block_size = batch * channels * height * width;
 
-		output.resize(batch, channels * height * width);
-		delta.resize(batch, channels * height * width);
+		reshape(output, batch, channels * height * width);
+		reshape(delta, batch, channels * height * width);
 	}
 
-	void Flatten::forward(const MatXf& prev_out, bool is_training)
+	void Flatten::forward(const MapXf& prev_out, bool is_training)
 	{
-		std::copy(prev_out.data(), prev_out.data() + out_block_size, output.data());
+		if (layout == Layout::NHWC) {
+			// (hw x channels) of a sample -> (channels x hw)
+			int hw = height * width;
+			for (int n = 0; n < batch; n++) {
+				MapXf(output.row(n).data(), channels, hw) = prev_out.middleRows(hw * n, hw).transpose();
+			}
+		}
+		else {
+			std::copy(prev_out.data(), prev_out.data() + out_block_size, output.data());
+		}
 	}
 
-	void Flatten::backward(const MatXf& prev_out, MatXf& prev_delta)
+	void Flatten::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
-		std::copy(delta.data(), delta.data() + out_block_size, prev_delta.data());
+		if (layout == Layout::NHWC) {
+			int hw = height * width;
+			for (int n = 0; n < batch; n++) {
+				prev_delta.middleRows(hw * n, hw) = MapXf(delta.row(n).data(), channels, hw).transpose();
+			}
+		}
+		else {
+			std::copy(delta.data(), delta.data() + out_block_size, prev_delta.data());
+		}
 	}
 
-	void Flatten::zero_grad() { delta.setZero(); }
-
 	vector<int> Flatten::output_shape() { return { batch, channels, height, width }; }
+
+	Layer* Flatten::clone() const { return new Flatten(*this); }
 }
\ No newline at end of file
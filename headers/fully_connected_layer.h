@@ -1,5 +1,6 @@
 #pragma once
 #include "layer.h"
+#include "activation_kernels.h"
 
 namespace simple_nn
 {
@@ -10,64 +11,106 @@ namespace simple_nn
 		int in_feat;
 		int out_feat;
 		string option;
+		ActivType activ;
 		MatXf dW;
 		RowVecXf db;
+		vector<MatXf> dW_part;		// per-thread gradients, summed in thread order
+		vector<RowVecXf> db_part;
 	public:
 		MatXf W;
 		RowVecXf b;
-		Linear(int in_features, int out_features, string option);
+		Linear(int in_features, int out_features, string option, ActivType activ = ActivType::NONE);
+		void set_activation(ActivType activ);
+		ActivType activation() const;
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		void update_weight(float lr, float decay) override;
 		void zero_grad() override;
 		vector<int> output_shape() override;
+		Layer* clone() const override;
+		vector<Param> params() override;
 	};
 
-	Linear::Linear(int in_features, int out_features, string option) :
+	Linear::Linear(int in_features, int out_features, string option, ActivType activ) :
 		Layer(LayerType::LINEAR),
 		batch(0),
 		in_feat(in_features),
 		out_feat(out_features),
-		option(option) {}
+		option(option),
+		activ(activ) {}
+
+	void Linear::set_activation(ActivType activ) { this->activ = activ; }
+
+	ActivType Linear::activation() const { return activ; }
 
 	void Linear::set_layer(const vector<int>& input_shape)
 	{
 		batch = input_shape[0];
 
-		output.resize(batch, out_feat);
-		delta.resize(batch, out_feat);
+		reshape(output, batch, out_feat);
+		reshape(delta, batch, out_feat);
 		W.resize(out_feat, in_feat);
-		dW.resize(out_feat, in_feat);
+		dW.resize(inference_only ? 0 : out_feat, in_feat);
 		b.resize(out_feat);
-		db.resize(out_feat);
+		db.resize(inference_only ? 0 : out_feat);
+		dW_part.assign(n_threads() > 1 && !inference_only ? n_threads() : 0, MatXf(out_feat, in_feat));
+		db_part.assign(dW_part.size(), RowVecXf(out_feat));
 
 		init_weight(W, in_feat, out_feat, option);
 		b.setZero();
 	}
 
-	void Linear::forward(const MatXf& prev_out, bool is_training)
+	void Linear::forward(const MapXf& prev_out, bool is_training)
 	{
-		for (int n = 0; n < batch; n++) {
-			output.row(n).noalias() = W * prev_out.row(n).transpose();
-			output.row(n).noalias() += b;
-		}
+		// one GEMM per thread over its rows of the batch: output(batch x out) = prev_out(batch x in) * W.T
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			output.middleRows(n0, n1 - n0).noalias() = prev_out.middleRows(n0, n1 - n0) * W.transpose();
+
+			// bias and activation in one pass over each output row while it is in L1
+			for (int n = n0; n < n1; n++) {
+				output.row(n) += b;
+				float* row = output.row(n).data();
+				if (activ == ActivType::RELU) relu_forward(row, row, out_feat);
+				else if (activ == ActivType::TANH) tanh_forward(row, row, out_feat);
+			}
+		});
 	}
 
-	void Linear::backward(const MatXf& prev_out, MatXf& prev_delta)
+	void Linear::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
-		// dW = delta(Vector) * prev_out(RowVector)
-		// db = delta
-		for (int n = 0; n < batch; n++) {
-			dW.noalias() += delta.row(n).transpose() * prev_out.row(n);
-			db.noalias() += delta.row(n);
-		}
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			int nb = n1 - n0;
+			auto d = delta.middleRows(n0, nb);
+			auto x = prev_out.middleRows(n0, nb);
 
-		// prev_delta = W.T * delta(Vector)
-		if (!is_first) {
-			for (int n = 0; n < batch; n++) {
-				prev_delta.row(n).noalias() = W.transpose() * delta.row(n).transpose();
+			// delta holds the gradient w.r.t. the activated output; the derivative is taken
+			// from the output itself (relu: y > 0, tanh: 1 - y^2)
+			const float* y = output.data() + (size_t)out_feat * n0;
+			float* dy = delta.data() + (size_t)out_feat * n0;
+			if (activ == ActivType::RELU) relu_backward(y, dy, dy, nb * out_feat);
+			else if (activ == ActivType::TANH) tanh_backward(y, dy, dy, nb * out_feat);
+
+			// dW = delta.T * prev_out, summed over the rows by the product itself
+			// db = column sums of delta
+			if (dW_part.empty()) {
+				dW.noalias() += d.transpose() * x;
+				db.noalias() += d.colwise().sum();
+			}
+			else {
+				dW_part[t].noalias() = d.transpose() * x;
+				db_part[t].noalias() = d.colwise().sum();
 			}
+
+			// prev_delta = delta * W
+			if (!is_first) {
+				prev_delta.middleRows(n0, nb).noalias() = d * W;
+			}
+		});
+
+		for (int t = 0; t < (int)dW_part.size(); t++) {
+			dW += dW_part[t];
+			db += db_part[t];
 		}
 	}
 
@@ -87,10 +130,16 @@ namespace simple_nn
 
 	void Linear::zero_grad()
 	{
-		delta.setZero();
 		dW.setZero();
 		db.setZero();
 	}
 
 	vector<int> Linear::output_shape() { return { batch, out_feat }; }
+
+	Layer* Linear::clone() const { return new Linear(*this); }
+
+	vector<Param> Linear::params()
+	{
+		return { { W.data(), dW.data(), (int)W.size() }, { b.data(), db.data(), (int)b.size() } };
+	}
 }
\ No newline at end of file
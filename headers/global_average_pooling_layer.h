@@ -0,0 +1,70 @@
+#pragma once
+#include "layer.h"
+
+namespace simple_nn
+{
+	// Averages every channel over its whole plane, a single reduction per (sample, channel).
+	// The output is batch x channels, and so is output_shape(), so it can feed a Linear head
+	// (optionally through BatchNorm1d or an activation) in place of Flatten -> Linear.
+	class GlobalAvgPool2d : public Layer
+	{
+	private:
+		int batch;
+		int ch;
+		int hw;
+	public:
+		GlobalAvgPool2d();
+		void set_layer(const vector<int>& input_shape) override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
+		vector<int> output_shape() override;
+		Layer* clone() const override;
+	};
+
+	GlobalAvgPool2d::GlobalAvgPool2d() :
+		Layer(LayerType::GLOBALAVGPOOL2D),
+		batch(0),
+		ch(0),
+		hw(0) {}
+
+	void GlobalAvgPool2d::set_layer(const vector<int>& input_shape)
+	{
+		assert(input_shape.size() == 4 && "GlobalAvgPool2d::set_layer(const vector<int>&): Must be followed by 2d layer.");
+
+		batch = input_shape[0];
+		ch = input_shape[1];
+		hw = input_shape[2] * input_shape[3];
+
+		reshape(output, batch, ch);
+		reshape(delta, batch, ch);
+	}
+
+	void GlobalAvgPool2d::forward(const MapXf& prev_out, bool is_training)
+	{
+		if (layout == Layout::NHWC) {
+			for (int n = 0; n < batch; n++) {
+				output.row(n) = prev_out.middleRows(hw * n, hw).colwise().mean();
+			}
+		}
+		else {
+			// row c + ch * n of the input is plane (n, c), element (n, c) of the output
+			Map<VecXf>(output.data(), batch * ch) = prev_out.rowwise().mean();
+		}
+	}
+
+	void GlobalAvgPool2d::backward(const MapXf& prev_out, MapXf& prev_delta)
+	{
+		if (layout == Layout::NHWC) {
+			for (int n = 0; n < batch; n++) {
+				prev_delta.middleRows(hw * n, hw).rowwise() = delta.row(n) / (float)hw;
+			}
+		}
+		else {
+			prev_delta.colwise() = Map<const VecXf>(delta.data(), batch * ch) / (float)hw;
+		}
+	}
+
+	vector<int> GlobalAvgPool2d::output_shape() { return { batch, ch }; }
+
+	Layer* GlobalAvgPool2d::clone() const { return new GlobalAvgPool2d(*this); }
+}
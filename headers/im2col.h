@@ -1,35 +1,216 @@
-float im2col_get_pixel(const float* im, int height, int width, int channels,
-                        int row, int col, int channel, int pad)
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+// Outputs [lo, hi) of a row of out_size elements whose input index
+// i * stride + offset lies in [0, in_size). Everything outside is padding.
+void im2col_valid_range(int in_size, int out_size, int stride, int offset, int& lo, int& hi)
 {
-    row -= pad;
-    col -= pad;
+    auto ceil_div = [](int a, int b) { return a >= 0 ? (a + b - 1) / b : -(-a / b); };
+    lo = std::min(out_size, std::max(0, ceil_div(-offset, stride)));
+    hi = std::max(lo, std::min(out_size, ceil_div(in_size - offset, stride)));
+}
 
-    if (row < 0 || col < 0 || row >= height || col >= width) return 0;
-    return im[col + width * (row + height * channel)];
+// Copies outputs [w0, w1) of one unfolded row: zeros over the padding,
+// a contiguous (stride 1) or strided copy over the interior [w_lo, w_hi).
+void im2col_row(const float* im_row, int w0, int w1, int w_lo, int w_hi,
+                int stride, float* dst)
+{
+    int a = std::min(w1, std::max(w0, w_lo));
+    int b = std::max(a, std::min(w1, w_hi));
+    std::fill(dst + w0, dst + a, 0.f);
+    if (stride == 1 && b - a >= 16) {
+        std::memcpy(dst + a, im_row + a, sizeof(float) * (b - a));
+    }
+    else if (stride == 1) {
+        for (int w = a; w < b; ++w) dst[w] = im_row[w];
+    }
+    else {
+        for (int w = a; w < b; ++w) dst[w] = im_row[w * stride];
+    }
+    std::fill(dst + b, dst + w1, 0.f);
 }
 
-// From Berkeley Vision's Caffe!
-// https://github.com/BVLC/caffe/blob/master/LICENSE
+// Unfolds one input channel into its ksize * ksize rows of data_col.
+// Channels are independent of each other, so they can be split across threads.
+void im2col_channel(const float* data_im, int height, int width,
+                    int ksize, int stride, int pad, int dilation,
+                    int height_col, int width_col, float* data_col, int col_stride)
+{
+    for (int ki = 0; ki < ksize; ++ki) {
+        int h_lo, h_hi;
+        im2col_valid_range(height, height_col, stride, ki * dilation - pad, h_lo, h_hi);
+        for (int kj = 0; kj < ksize; ++kj) {
+            int w_lo, w_hi;
+            im2col_valid_range(width, width_col, stride, kj * dilation - pad, w_lo, w_hi);
+            float* dst = data_col + (ki * ksize + kj) * col_stride;
+            std::fill(dst, dst + h_lo * width_col, 0.f);
+            for (int h = h_lo; h < h_hi; ++h) {
+                // im_row[w * stride] is the input pixel under output column w
+                const float* im_row = data_im + (h * stride + ki * dilation - pad) * width
+                    + kj * dilation - pad;
+                im2col_row(im_row, 0, width_col, w_lo, w_hi, stride, dst + h * width_col);
+            }
+            std::fill(dst + h_hi * width_col, dst + height_col * width_col, 0.f);
+        }
+    }
+}
+
+// Same contract as Berkeley Vision's Caffe im2col
+// (https://github.com/BVLC/caffe/blob/master/LICENSE), but padding is resolved
+// per row up front instead of bounds-checking every element.
+// col_stride: distance between two rows of data_col (0 = height_col * width_col).
 void im2col(const float* data_im, int channels, int height, int width,
-            int ksize, int stride, int pad, float* data_col)
+            int ksize, int stride, int pad, int dilation, float* data_col, int col_stride = 0)
+{
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+
+    if (col_stride == 0) col_stride = height_col * width_col;
+
+    for (int c = 0; c < channels; ++c) {
+        im2col_channel(data_im + c * height * width, height, width, ksize, stride, pad, dilation,
+            height_col, width_col, data_col + c * ksize * ksize * col_stride, col_stride);
+    }
+}
+
+// Unfolds rows [row0, row0 + rows) and columns [col0, col0 + cols) of the im2col
+// matrix into a dense rows x cols panel, without materializing the whole matrix.
+void im2col_panel(const float* data_im, int channels, int height, int width,
+                  int ksize, int stride, int pad, int dilation,
+                  int row0, int rows, int col0, int cols, float* panel)
 {
-    int c, h, w;
-    int height_col = (height + 2 * pad - ksize) / stride + 1;
-    int width_col = (width + 2 * pad - ksize) / stride + 1;
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
 
-    int channels_col = channels * ksize * ksize;
-    for (c = 0; c < channels_col; ++c) {
-        int w_offset = c % ksize;
-        int h_offset = (c / ksize) % ksize;
+    for (int r = 0; r < rows; ++r) {
+        int c = row0 + r;
+        int kj = c % ksize;
+        int ki = (c / ksize) % ksize;
         int c_im = c / ksize / ksize;
-        for (h = 0; h < height_col; ++h) {
-            for (w = 0; w < width_col; ++w) {
-                int im_row = h_offset + h * stride;
-                int im_col = w_offset + w * stride;
-                int col_index = (c * height_col + h) * width_col + w;
-                data_col[col_index] = im2col_get_pixel(data_im, height, width, channels,
-                    im_row, im_col, c_im, pad);
+        int h_lo, h_hi, w_lo, w_hi;
+        im2col_valid_range(height, height_col, stride, ki * dilation - pad, h_lo, h_hi);
+        im2col_valid_range(width, width_col, stride, kj * dilation - pad, w_lo, w_hi);
+
+        // dst[p] is output position p, split into segments of one output row each
+        float* dst = panel + r * cols - col0;
+        for (int p = col0; p < col0 + cols;) {
+            int h = p / width_col;
+            int w0 = p - h * width_col;
+            int w1 = std::min(width_col, w0 + col0 + cols - p);
+            float* dst_row = dst + h * width_col;
+            if (h < h_lo || h >= h_hi) {
+                std::fill(dst_row + w0, dst_row + w1, 0.f);
             }
+            else {
+                const float* im_row = data_im + (c_im * height + h * stride + ki * dilation - pad) * width
+                    + kj * dilation - pad;
+                im2col_row(im_row, w0, w1, w_lo, w_hi, stride, dst_row);
+            }
+            p += w1 - w0;
+        }
+    }
+}
+
+// Channels-last im2col: data_im is height x width x channels and row p of data_col
+// is the receptive field of output pixel p, ordered (group, ki, kj, channel in group).
+// Each group is a contiguous block of columns and each tap copies contiguous channels.
+void im2col_nhwc(const float* data_im, int channels, int height, int width,
+                 int ksize, int stride, int pad, int dilation, int groups, float* data_col)
+{
+    int height_col = (height + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int width_col = (width + 2 * pad - dilation * (ksize - 1) - 1) / stride + 1;
+    int cg = channels / groups;
+    int group_len = cg * ksize * ksize;
+
+    if (groups == 1 && dilation == 1) {
+        // the ksize taps of a kernel row are adjacent pixels, i.e. one span of ksize * channels
+        for (int h = 0; h < height_col; ++h) {
+            for (int w = 0; w < width_col; ++w) {
+                float* dst = data_col + (h * width_col + w) * group_len;
+                int w_start = w * stride - pad;
+                int lo = std::max(0, -w_start) * channels;
+                int hi = std::max(lo, std::min(ksize, width - w_start) * channels);
+                for (int ki = 0; ki < ksize; ++ki) {
+                    int hh = h * stride + ki - pad;
+                    float* d = dst + ki * ksize * channels;
+                    if (hh < 0 || hh >= height) {
+                        std::fill(d, d + ksize * channels, 0.f);
+                        continue;
+                    }
+                    const float* src = data_im + (hh * width + w_start) * channels;
+                    std::fill(d, d + lo, 0.f);
+                    if (hi - lo >= 16) std::memcpy(d + lo, src + lo, sizeof(float) * (hi - lo));
+                    else for (int i = lo; i < hi; ++i) d[i] = src[i];
+                    std::fill(d + hi, d + ksize * channels, 0.f);
+                }
+            }
+        }
+        return;
+    }
+
+    for (int h = 0; h < height_col; ++h) {
+        for (int w = 0; w < width_col; ++w) {
+            float* dst = data_col + (h * width_col + w) * channels * ksize * ksize;
+            for (int ki = 0; ki < ksize; ++ki) {
+                int hh = h * stride + ki * dilation - pad;
+                for (int kj = 0; kj < ksize; ++kj) {
+                    int ww = w * stride + kj * dilation - pad;
+                    const float* src = data_im + (hh * width + ww) * channels;
+                    bool inside = hh >= 0 && hh < height && ww >= 0 && ww < width;
+                    for (int g = 0; g < groups; ++g) {
+                        float* d = dst + g * group_len + (ki * ksize + kj) * cg;
+                        if (inside) std::memcpy(d, src + g * cg, sizeof(float) * cg);
+                        else std::fill(d, d + cg, 0.f);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Calls f(std::integral_constant<int, I>()) for every I of the sequence, fully unrolled.
+template<int... I, class F>
+void unroll(std::integer_sequence<int, I...>, F&& f)
+{
+    (f(std::integral_constant<int, I>()), ...);
+}
+
+// im2col for a fixed ksize x ksize kernel, stride and padding (dilation 1). The window
+// loops are unrolled and the padding columns of every tap are compile-time constants.
+template<int K, int S, int P>
+void im2col_k(const float* data_im, int channels, int height, int width,
+              float* data_col, int col_stride = 0)
+{
+    int height_col = (height + 2 * P - K) / S + 1;
+    int width_col = (width + 2 * P - K) / S + 1;
+
+    if (col_stride == 0) col_stride = height_col * width_col;
+
+    for (int c = 0; c < channels; ++c) {
+        const float* im = data_im + c * height * width;
+        float* col = data_col + c * K * K * col_stride;
+        for (int h = 0; h < height_col; ++h) {
+            unroll(std::make_integer_sequence<int, K>(), [&](auto ki) {
+                int hh = h * S + ki - P;
+                bool inside = hh >= 0 && hh < height;
+                unroll(std::make_integer_sequence<int, K>(), [&](auto kj) {
+                    // output w reads input column w * S + kj - P
+                    constexpr int w_lo = kj < P ? (P - kj + S - 1) / S : 0;
+                    float* dst = col + (ki * K + kj) * col_stride + h * width_col;
+                    if (!inside) {
+                        std::fill(dst, dst + width_col, 0.f);
+                        return;
+                    }
+                    int w_hi = std::max(w_lo, std::min(width_col, (width - 1 + P - kj) / S + 1));
+                    const float* im_row = im + hh * width + kj - P;
+                    std::fill(dst, dst + w_lo, 0.f);
+                    if (S == 1) std::memcpy(dst + w_lo, im_row + w_lo, sizeof(float) * (w_hi - w_lo));
+                    else for (int w = w_lo; w < w_hi; ++w) dst[w] = im_row[w * S];
+                    std::fill(dst + w_hi, dst + width_col, 0.f);
+                });
+            });
         }
     }
 }
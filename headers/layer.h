@@ -1,5 +1,6 @@
 #pragma once
 #include "common.h"
+#include "thread_pool.h"
 
 namespace simple_nn
 {
@@ -9,27 +10,117 @@ namespace simple_nn
 		CONV2D,
 		MAXPOOL2D,
 		AVGPOOL2D,
+		GLOBALAVGPOOL2D,
 		ACTIVATION,
 		BATCHNORM1D,
 		BATCHNORM2D,
 		FLATTEN
 	};
 
+	// Storage order of 4d tensors.
+	// NCHW: (batch * channels) x (height * width), NHWC: (batch * height * width) x channels.
+	enum class Layout
+	{
+		NCHW,
+		NHWC
+	};
+
+	// Activation applied by a layer to its own output (see Linear).
+	enum class ActivType
+	{
+		NONE,
+		RELU,
+		TANH
+	};
+
+	// A parameter tensor of a layer and its gradient as flat arrays; grad is nullptr for state that
+	// is not trained (the moving statistics of BatchNorm).
+	struct Param
+	{
+		float* value;
+		float* grad;
+		int size;
+	};
+
+	// When a scratch buffer of a layer holds data, for SimpleNN::compile to place it.
+	enum class Lifetime
+	{
+		STEP,	// from forward to backward of the layer (kept for backward)
+		CALL	// within one forward or backward of the layer
+	};
+
+	// A buffer of a set layer for the arena of SimpleNN::compile: its size and a function that
+	// points its view at the memory given, keeping the shape.
+	struct Buffer
+	{
+		size_t bytes;
+		Lifetime lifetime;
+		std::function<void(char*)> place;
+	};
+
+	// Gives a view its shape; it points nowhere until SimpleNN::compile places it.
+	template<typename MapT>
+	void reshape(MapT& view, Index rows, Index cols = 1)
+	{
+		new (&view) MapT(nullptr, rows, cols);
+	}
+
+	template<typename MapT>
+	Buffer make_buffer(MapT& view, Lifetime lifetime)
+	{
+		typedef typename MapT::Scalar T;
+		return { sizeof(T) * view.size(), lifetime, [&view](char* data) { new (&view) MapT((T*)data, view.rows(), view.cols()); } };
+	}
+
 	class Layer
 	{
 	public:
 		LayerType type;
 		bool is_first;
 		bool is_last;
-		MatXf output;
-		MatXf delta;
+		bool in_place;	// output and delta alias the previous layer's (set by SimpleNN::compile)
+		bool inference_only;	// forward passes only: no gradient state is allocated (set by SimpleNN::compile)
+		Layout layout;
+		ThreadPool* pool;	// intra-op threads (set by SimpleNN::compile); nullptr runs serially
+		MapXf output;
+		MapXf delta;
 	public:
-		Layer(LayerType type) : type(type), is_first(false), is_last(false) {}
+		Layer(LayerType type) :
+			type(type), is_first(false), is_last(false), in_place(false), inference_only(false), layout(Layout::NCHW), pool(nullptr),
+			output(nullptr, 0, 0), delta(nullptr, 0, 0) {}
+		virtual ~Layer() {}
 		virtual void set_layer(const vector<int>& input_shape) = 0;
-		virtual void forward(const MatXf& prev_out, bool is_training = true) = 0;
-		virtual void backward(const MatXf& prev_out, MatXf& prev_delta) = 0;
+		virtual void forward(const MapXf& prev_out, bool is_training = true) = 0;
+		// prev_delta is zeroed before; layers may add into it.
+		virtual void backward(const MapXf& prev_out, MapXf& prev_delta) = 0;
 		virtual void update_weight(float lr, float decay) { return; }
 		virtual void zero_grad() { return; }
 		virtual vector<int> output_shape() = 0;
+		// Returns a copy of the (set) layer with kernels specialized at compile time for its
+		// configuration, or nullptr if there is none.
+		virtual Layer* specialize() { return nullptr; }
+		// Returns an unset copy of the layer for a data-parallel replica (see SimpleNN::set_replicas),
+		// or nullptr if it cannot be replicated. Called before set_layer.
+		virtual Layer* clone() const { return nullptr; }
+		// The parameters of the set layer, in the order save/load uses.
+		virtual vector<Param> params() { return {}; }
+		// The scratch buffers of the set layer (output and delta are placed by SimpleNN::compile).
+		virtual vector<Buffer> buffers() { return {}; }
+		// Elementwise layers whose gradient follows from their output can overwrite the previous
+		// layer's buffers: x holds the input and receives the output, d holds the gradient w.r.t.
+		// the output (y) and receives the gradient w.r.t. the input.
+		virtual bool supports_in_place() const { return false; }
+		virtual void forward_in_place(MapXf& x) { return; }
+		virtual void backward_in_place(const MapXf& y, MapXf& d) { return; }
+	protected:
+		// Splits [0, n) over the pool (see ThreadPool::run); f(begin, end, t) with t < n_threads().
+		template<typename F>
+		void parallel_for(int n, const F& f, int grain = 1)
+		{
+			if (pool == nullptr) f(0, n, 0);
+			else pool->run(n, f, grain);
+		}
+
+		int n_threads() const { return pool == nullptr ? 1 : pool->size(); }
 	};
 }
\ No newline at end of file
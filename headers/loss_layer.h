@@ -10,6 +10,7 @@ namespace simple_nn
 		int n_label;
 	public:
 		Loss() : batch(0), n_label(0) {}
+		virtual ~Loss() {}
 
 		void set_layer(const vector<int>& input_shape)
 		{
@@ -18,7 +19,9 @@ namespace simple_nn
 			n_label = input_shape[1];
 		}
 
-		virtual float calc_loss(const MatXf& prev_out, const VecXi& labels, MatXf& prev_delta) = 0;
+		virtual float calc_loss(const MapXf& prev_out, const VecXi& labels, MapXf& prev_delta) = 0;
+
+		virtual Loss* clone() const = 0;
 	};
 
 	class MSELoss : public Loss
@@ -26,7 +29,9 @@ namespace simple_nn
 	public:
 		MSELoss() : Loss() {}
 
-		float calc_loss(const MatXf& prev_out, const VecXi& labels, MatXf& prev_delta) override
+		Loss* clone() const override { return new MSELoss(*this); }
+
+		float calc_loss(const MapXf& prev_out, const VecXi& labels, MapXf& prev_delta) override
 		{
 			float loss_batch = 0.f, loss = 0.f;
 			prev_delta = prev_out;
@@ -47,7 +52,9 @@ namespace simple_nn
 	public:
 		CrossEntropyLoss() : Loss() {}
 
-		float calc_loss(const MatXf& prev_out, const VecXi& labels, MatXf& prev_delta)
+		Loss* clone() const override { return new CrossEntropyLoss(*this); }
+
+		float calc_loss(const MapXf& prev_out, const VecXi& labels, MapXf& prev_delta)
 		{
 			float loss_batch = 0.f;
 			prev_delta = prev_out;
@@ -59,4 +66,33 @@ namespace simple_nn
 			return loss_batch / batch;
 		}
 	};
+
+	// Cross entropy of a Softmax computed from the logits in one pass per row, with
+	// -log(p_y) = log(sum(exp(x - max))) - (x_y - max), so the loss stays finite where p_y
+	// underflows. The delta (p - onehot) is written in place of the probabilities; the network
+	// ends at the logits. SimpleNN::compile uses it for a Softmax output with CrossEntropyLoss.
+	class SoftmaxCrossEntropyLoss : public Loss
+	{
+	public:
+		SoftmaxCrossEntropyLoss() : Loss() {}
+
+		Loss* clone() const override { return new SoftmaxCrossEntropyLoss(*this); }
+
+		float calc_loss(const MapXf& prev_out, const VecXi& labels, MapXf& prev_delta) override
+		{
+			float loss_batch = 0.f;
+			for (int n = 0; n < batch; n++) {
+				Map<const ArrayXf> logit(prev_out.data() + (size_t)n_label * n, n_label);
+				Map<ArrayXf> grad(prev_delta.data() + (size_t)n_label * n, n_label);
+				int answer_idx = labels[n];
+				float max = logit.maxCoeff();
+				grad = (logit - max).exp();
+				float sum = grad.sum();
+				grad *= 1.f / sum;
+				grad[answer_idx] -= 1.f;
+				loss_batch += std::log(sum) - (logit[answer_idx] - max);
+			}
+			return loss_batch / batch;
+		}
+	};
 }
\ No newline at end of file
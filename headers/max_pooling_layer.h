@@ -7,7 +7,7 @@ namespace simple_nn
 
 	class MaxPool2d : public Layer
 	{
-	private:
+	protected:
 		int batch;
 		int ch;
 		int ih;
@@ -19,15 +19,27 @@ namespace simple_nn
 		int kh;
 		int kw;
 		int stride;
-		MatXf im_col;
-		vector<int> indices;
+		int code_bits;
+		bool compact_mask;
+		MapXi indices;
+		vector<uint8_t> codes;		// window-local argmax, code_bits per output in compact mask mode
+		vector<int> window_offset;	// input offset of each window position from the window origin
 	public:
 		MaxPool2d(int kernel_size, int stride);
+		void set_compact_mask(bool enable);
 		void set_layer(const vector<int>& input_shape) override;
-		void forward(const MatXf& prev_out, bool is_training) override;
-		void backward(const MatXf& prev_out, MatXf& prev_delta) override;
-		void zero_grad() override;
+		void forward(const MapXf& prev_out, bool is_training) override;
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override;
 		vector<int> output_shape() override;
+		Layer* clone() const override;
+		Layer* specialize() override;
+		vector<Buffer> buffers() override;
+	protected:
+		void save_argmax(int out_idx, int in_idx, int window_pos);
+		int mask_grain(int outputs) const;
+	private:
+		void forward_nhwc(const MapXf& prev_out);
+		void backward_compact(MapXf& prev_delta);
 	};
 
 	MaxPool2d::MaxPool2d(int kernel_size, int stride) :
@@ -42,7 +54,12 @@ namespace simple_nn
 		ohw(0),
 		kh(kernel_size),
 		kw(kernel_size),
-		stride(stride) {}
+		stride(stride),
+		code_bits(0),
+		compact_mask(false),
+		indices(nullptr, 0) {}
+
+	void MaxPool2d::set_compact_mask(bool enable) { compact_mask = enable; }
 
 	void MaxPool2d::set_layer(const vector<int>& input_shape)
 	{
@@ -55,56 +72,298 @@ namespace simple_nn
 		ow = calc_outsize(iw, kw, stride, 0);
 		ohw = oh * ow;
 
-		output.resize(batch * ch, ohw);
-		delta.resize(batch * ch, ohw);
-		im_col.resize(kh * kw, ohw);
-		indices.resize(batch * ch * ohw);
+		if (layout == Layout::NHWC) {
+			reshape(output, batch * ohw, ch);
+			reshape(delta, batch * ohw, ch);
+		}
+		else {
+			reshape(output, batch * ch, ohw);
+			reshape(delta, batch * ch, ohw);
+		}
+
+		// compact masks store the position of the max within its window in 1, 2 or 4 bits
+		// (windows of up to 16 elements); larger windows keep absolute indices
+		int taps = kh * kw;
+		code_bits = !compact_mask || taps > 16 ? 0 : taps <= 2 ? 1 : taps <= 4 ? 2 : 4;
+		size_t n_out = (size_t)batch * ch * ohw;
+		if (inference_only) {
+			// nothing is routed back, so no argmax is kept
+			codes.clear();
+			reshape(indices, 0);
+		}
+		else if (code_bits > 0) {
+			codes.resize((n_out * code_bits + 7) / 8);
+			reshape(indices, 0);
+			window_offset.resize(taps);
+			int step = layout == Layout::NHWC ? ch : 1;
+			for (int y = 0; y < kh; y++) {
+				for (int x = 0; x < kw; x++) {
+					window_offset[kw * y + x] = step * (iw * y + x);
+				}
+			}
+		}
+		else {
+			codes.clear();
+			reshape(indices, n_out);
+		}
+	}
+
+	void MaxPool2d::save_argmax(int out_idx, int in_idx, int window_pos)
+	{
+		if (inference_only) return;
+		if (code_bits == 0) {
+			indices[out_idx] = in_idx;
+			return;
+		}
+		size_t bit = (size_t)out_idx * code_bits;
+		codes[bit >> 3] |= (uint8_t)(window_pos << (bit & 7));
 	}
 
-	void MaxPool2d::forward(const MatXf& prev_out, bool is_training)
+	void MaxPool2d::forward(const MapXf& prev_out, bool is_training)
 	{
+		if (layout == Layout::NHWC) {
+			forward_nhwc(prev_out);
+			return;
+		}
+
+		std::fill(codes.begin(), codes.end(), 0);
 		float* out = output.data();
 		const float* pout = prev_out.data();
-		for (int n = 0; n < batch; n++) {
-			for (int c = 0; c < ch; c++) {
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			for (int n = n0; n < n1; n++) {
+				for (int c = 0; c < ch; c++) {
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							int out_idx = j + ow * (i + oh * (c + ch * n));
+							float max = FLOAT_MIN;
+							int max_idx = -1;
+							int max_pos = 0;
+							for (int y = 0; y < kh; y++) {
+								for (int x = 0; x < kw; x++) {
+									int ii = i * stride + y;
+									int jj = j * stride + x;
+									int pout_idx = jj + iw * (ii + ih * (c + ch * n));
+									float val = FLOAT_MIN;
+									if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
+										val = pout[pout_idx];
+									}
+									if (val > max) {
+										max = val;
+										max_idx = pout_idx;
+										max_pos = kw * y + x;
+									}
+								}
+							}
+							out[out_idx] = max;
+							save_argmax(out_idx, max_idx, max_pos);
+						}
+					}
+				}
+			}
+		}, mask_grain(ch * ohw));
+	}
+
+	// Channels-last: the window of each output pixel is compared one channel vector at a time.
+	// indices still hold flat input positions, so backward does not depend on the layout.
+	void MaxPool2d::forward_nhwc(const MapXf& prev_out)
+	{
+		std::fill(codes.begin(), codes.end(), 0);
+		const float* pout = prev_out.data();
+		parallel_for(batch, [&](int n0, int n1, int t) {
+			vector<int> pos(ch);
+			for (int n = n0; n < n1; n++) {
 				for (int i = 0; i < oh; i++) {
 					for (int j = 0; j < ow; j++) {
-						int out_idx = j + ow * (i + oh * (c + ch * n));
-						float max = FLOAT_MIN;
-						int max_idx = -1;
+						int out_idx = ch * (j + ow * (i + oh * n));
+						float* out = output.data() + out_idx;
+						std::fill(out, out + ch, FLOAT_MIN);
+						std::fill(pos.begin(), pos.end(), -1);
 						for (int y = 0; y < kh; y++) {
 							for (int x = 0; x < kw; x++) {
 								int ii = i * stride + y;
 								int jj = j * stride + x;
-								int pout_idx = jj + iw * (ii + ih * (c + ch * n));
-								float val = FLOAT_MIN;
-								if (ii >= 0 && ii < ih && jj >= 0 && jj < iw) {
-									val = pout[pout_idx];
-								}
-								if (val > max) {
-									max = val;
-									max_idx = pout_idx;
+								if (ii < 0 || ii >= ih || jj < 0 || jj >= iw) continue;
+								const float* in = pout + ch * (jj + iw * (ii + ih * n));
+								for (int c = 0; c < ch; c++) {
+									if (in[c] > out[c]) {
+										out[c] = in[c];
+										pos[c] = kw * y + x;
+									}
 								}
 							}
 						}
-						out[out_idx] = max;
-						indices[out_idx] = max_idx;
+						int origin = ch * (j * stride + iw * (i * stride + ih * n));
+						for (int c = 0; c < ch; c++) {
+							int in_idx = pos[c] < 0 ? -1 : origin + ch * (iw * (pos[c] / kw) + pos[c] % kw) + c;
+							save_argmax(out_idx + c, in_idx, std::max(pos[c], 0));
+						}
 					}
 				}
 			}
-		}
+		}, mask_grain(ch * ohw));
 	}
 
-	void MaxPool2d::backward(const MatXf& prev_out, MatXf& prev_delta)
+	void MaxPool2d::backward(const MapXf& prev_out, MapXf& prev_delta)
 	{
+		if (code_bits > 0) {
+			backward_compact(prev_delta);
+			return;
+		}
+
+		// the outputs of a plane (NCHW) or sample (NHWC) scatter into their own input plane or sample
 		float* pd = prev_delta.data();
 		const float* d = delta.data();
-		for (int i = 0; i < indices.size(); i++) {
-			pd[indices[i]] += d[i];
+		parallel_for((int)indices.size(), [&](int i0, int i1, int t) {
+			for (int i = i0; i < i1; i++) {
+				pd[indices[i]] += d[i];
+			}
+		}, layout == Layout::NHWC ? ch * ohw : ohw);
+	}
+
+	// Decodes the window-local argmax of each output into an input offset with a table lookup.
+	// Outputs are visited in storage order, so the codes are read sequentially.
+	void MaxPool2d::backward_compact(MapXf& prev_delta)
+	{
+		float* pd = prev_delta.data();
+		const uint8_t* code = codes.data();
+		const int* offset = window_offset.data();
+		int code_mask = (1 << code_bits) - 1;
+
+		if (layout == Layout::NHWC) {
+			parallel_for(batch, [&](int n0, int n1, int t) {
+				const float* d = delta.data() + (size_t)ch * ohw * n0;
+				size_t bit = (size_t)ch * ohw * n0 * code_bits;
+				for (int n = n0; n < n1; n++) {
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							float* origin = pd + ch * (j * stride + iw * (i * stride + ih * n));
+							for (int c = 0; c < ch; c++, bit += code_bits) {
+								int pos = (code[bit >> 3] >> (bit & 7)) & code_mask;
+								origin[offset[pos] + c] += *d++;
+							}
+						}
+					}
+				}
+			});
+		}
+		else {
+			parallel_for(batch * ch, [&](int p0, int p1, int t) {
+				const float* d = delta.data() + (size_t)ohw * p0;
+				size_t bit = (size_t)ohw * p0 * code_bits;
+				for (int p = p0; p < p1; p++) {
+					for (int i = 0; i < oh; i++) {
+						float* origin = pd + ihw * p + iw * i * stride;
+						for (int j = 0; j < ow; j++, bit += code_bits) {
+							int pos = (code[bit >> 3] >> (bit & 7)) & code_mask;
+							origin[offset[pos] + j * stride] += *d++;
+						}
+					}
+				}
+			});
 		}
 	}
 
-	void MaxPool2d::zero_grad() { delta.setZero(); }
+	// Samples or planes of `outputs` outputs per chunk of work such that no two chunks share a
+	// byte of the compact mask.
+	int MaxPool2d::mask_grain(int outputs) const
+	{
+		return code_bits == 0 ? 1 : 8 / std::gcd(8, outputs * code_bits);
+	}
 
 	vector<int> MaxPool2d::output_shape() { return { batch, ch, oh, ow }; }
+
+	Layer* MaxPool2d::clone() const { return new MaxPool2d(*this); }
+
+	vector<Buffer> MaxPool2d::buffers() { return { make_buffer(indices, Lifetime::STEP) }; }
+
+	// MaxPool2d with the window and stride fixed at compile time. Windows never leave the
+	// input (no padding), so the unrolled loops need no bounds checks.
+	template<int K, int S>
+	class MaxPool2dK : public MaxPool2d
+	{
+	public:
+		MaxPool2dK() : MaxPool2d(K, S) {}
+		MaxPool2dK(const MaxPool2d& pool) : MaxPool2d(pool) {}
+		Layer* specialize() override { return nullptr; }
+
+		void forward(const MapXf& prev_out, bool is_training) override
+		{
+			if (layout != Layout::NCHW) {
+				MaxPool2d::forward(prev_out, is_training);
+				return;
+			}
+
+			// The comparisons are branch-free (a taken/not-taken branch per tap mispredicts on
+			// typical activations): each window row is reduced on its own, then the row maxima are
+			// combined, so the chains are short and ties still go to the first position in raster order.
+			// Planes are split across threads.
+			std::fill(codes.begin(), codes.end(), 0);
+			parallel_for(batch * ch, [&](int p0, int p1, int t) {
+				for (int p = p0; p < p1; p++) {
+					const float* im = prev_out.data() + ihw * p;
+					float* out = output.data() + ohw * p;
+					for (int i = 0; i < oh; i++) {
+						for (int j = 0; j < ow; j++) {
+							int first = iw * i * S + j * S;
+							float row_max[K];
+							int row_x[K];
+							unroll(std::make_integer_sequence<int, K>(), [&](auto y) {
+								const float* row = im + first + iw * y;
+								row_max[y] = row[0];
+								row_x[y] = 0;
+								unroll(std::make_integer_sequence<int, K - 1>(), [&](auto x1) {
+									int greater = row[x1 + 1] > row_max[y];
+									row_max[y] = std::max(row_max[y], row[x1 + 1]);
+									row_x[y] += greater * (x1 + 1 - row_x[y]);
+								});
+							});
+							float max = row_max[0];
+							int max_yx = row_x[0];
+							unroll(std::make_integer_sequence<int, K - 1>(), [&](auto y1) {
+								int greater = row_max[y1 + 1] > max;
+								max = std::max(max, row_max[y1 + 1]);
+								max_yx += greater * (K * (y1 + 1) + row_x[y1 + 1] - max_yx);
+							});
+							out[ow * i + j] = max;
+							save_argmax(ohw * p + ow * i + j, ihw * p + first + iw * (max_yx / K) + max_yx % K, max_yx);
+						}
+					}
+				}
+			}, mask_grain(ohw));
+		}
+
+		// compact masks are decoded with the code width and window offsets known at compile time
+		void backward(const MapXf& prev_out, MapXf& prev_delta) override
+		{
+			constexpr int BITS = K * K <= 4 ? 2 : 4;
+			if (layout != Layout::NCHW || code_bits != BITS) {
+				MaxPool2d::backward(prev_out, prev_delta);
+				return;
+			}
+
+			const uint8_t* code = codes.data();
+			parallel_for(batch * ch, [&](int p0, int p1, int t) {
+				const float* d = delta.data() + (size_t)ohw * p0;
+				size_t bit = (size_t)ohw * p0 * BITS;
+				for (int p = p0; p < p1; p++) {
+					for (int i = 0; i < oh; i++) {
+						float* origin = prev_delta.data() + ihw * p + iw * i * S;
+						for (int j = 0; j < ow; j++, bit += BITS) {
+							int pos = (code[bit >> 3] >> (bit & 7)) & ((1 << BITS) - 1);
+							origin[iw * (pos / K) + pos % K + j * S] += *d++;
+						}
+					}
+				}
+			});
+		}
+	};
+
+	Layer* MaxPool2d::specialize()
+	{
+		if (layout != Layout::NCHW) return nullptr;
+
+		if (kh == 2 && stride == 2) return new MaxPool2dK<2, 2>(*this);
+		if (kh == 3 && stride == 2) return new MaxPool2dK<3, 2>(*this);
+		return nullptr;
+	}
 }
\ No newline at end of file
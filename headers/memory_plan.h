@@ -0,0 +1,99 @@
+#pragma once
+#include "common.h"
+
+namespace simple_nn
+{
+	// blocks of the arena start on cache lines
+	const size_t ARENA_ALIGN = 64;
+
+	// Offsets of buffers in one arena such that buffers live at the same time never overlap.
+	// A buffer is live over a list of closed time ranges; two buffers conflict if any of their
+	// ranges intersect. Buffers are placed largest first, each in the smallest gap between the
+	// conflicting buffers already placed that holds it, else above all of them.
+	class MemoryPlan
+	{
+	private:
+		struct Block
+		{
+			size_t bytes;
+			vector<pair<int, int>> live;
+			size_t offset;
+		};
+		vector<Block> blocks;
+		size_t arena_bytes;
+	public:
+		MemoryPlan();
+		// Returns the index of the buffer.
+		int add(size_t bytes, const vector<pair<int, int>>& live);
+		void plan();
+		size_t offset(int b) const;
+		// Bytes of the arena.
+		size_t size() const;
+		// Bytes of the buffers allocated one by one.
+		size_t unplanned_size() const;
+	private:
+		static bool conflict(const Block& a, const Block& b);
+	};
+
+	MemoryPlan::MemoryPlan() : arena_bytes(0) {}
+
+	int MemoryPlan::add(size_t bytes, const vector<pair<int, int>>& live)
+	{
+		size_t aligned = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+		blocks.push_back({ aligned, live, 0 });
+		return (int)blocks.size() - 1;
+	}
+
+	void MemoryPlan::plan()
+	{
+		vector<int> order(blocks.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return blocks[a].bytes > blocks[b].bytes; });
+
+		arena_bytes = 0;
+		vector<int> placed;
+		for (int b : order) {
+			Block& block = blocks[b];
+			vector<pair<size_t, size_t>> taken;
+			for (int p : placed) {
+				if (conflict(block, blocks[p])) taken.push_back({ blocks[p].offset, blocks[p].offset + blocks[p].bytes });
+			}
+			std::sort(taken.begin(), taken.end());
+
+			size_t best = SIZE_MAX;
+			size_t best_gap = SIZE_MAX;
+			size_t end = 0;
+			for (const auto& t : taken) {
+				if (t.first >= end && t.first - end >= block.bytes && t.first - end < best_gap) {
+					best = end;
+					best_gap = t.first - end;
+				}
+				end = std::max(end, t.second);
+			}
+			block.offset = best != SIZE_MAX ? best : end;
+			placed.push_back(b);
+			arena_bytes = std::max(arena_bytes, block.offset + block.bytes);
+		}
+	}
+
+	size_t MemoryPlan::offset(int b) const { return blocks[b].offset; }
+
+	size_t MemoryPlan::size() const { return arena_bytes; }
+
+	size_t MemoryPlan::unplanned_size() const
+	{
+		size_t bytes = 0;
+		for (const Block& b : blocks) bytes += b.bytes;
+		return bytes;
+	}
+
+	bool MemoryPlan::conflict(const Block& a, const Block& b)
+	{
+		for (const auto& x : a.live) {
+			for (const auto& y : b.live) {
+				if (x.first <= y.second && y.first <= x.second) return true;
+			}
+		}
+		return false;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include "common.h"
+
+namespace simple_nn
+{
+	// The replicas of a data-parallel model (see SimpleNN::set_replicas), each running on its own
+	// thread. Every replica calls the collectives in the same order with its rank; a call returns
+	// once all of them have made it. all_reduce leaves the element-wise sum in every replica's array,
+	// added up in order of rank, so all replicas get the same bits.
+	class ReplicaGroup
+	{
+	private:
+		int n;
+		mutex m;
+		condition_variable cv;
+		int arrived;
+		unsigned phase;
+		vector<const void*> bufs;
+	public:
+		ReplicaGroup();
+		void set_size(int n_replicas);
+		int size() const;
+		template<typename T>
+		void all_reduce(int rank, T* data, int len);
+		// Copies the array of rank 0 to the others.
+		template<typename T>
+		void broadcast(int rank, T* data, int len);
+	private:
+		void barrier();
+	};
+
+	ReplicaGroup::ReplicaGroup() : n(1), arrived(0), phase(0), bufs(1) {}
+
+	void ReplicaGroup::set_size(int n_replicas)
+	{
+		n = n_replicas;
+		bufs.assign(n, nullptr);
+	}
+
+	int ReplicaGroup::size() const { return n; }
+
+	template<typename T>
+	void ReplicaGroup::all_reduce(int rank, T* data, int len)
+	{
+		if (n == 1) return;
+
+		typedef Array<T, Dynamic, 1> ArrT;
+		bufs[rank] = data;
+		barrier();
+		ArrT sum = Map<const ArrT>((const T*)bufs[0], len);
+		for (int r = 1; r < n; r++) {
+			sum += Map<const ArrT>((const T*)bufs[r], len);
+		}
+		// the others are done reading this replica's array before it is overwritten
+		barrier();
+		Map<ArrT>(data, len) = sum;
+	}
+
+	template<typename T>
+	void ReplicaGroup::broadcast(int rank, T* data, int len)
+	{
+		if (n == 1) return;
+
+		bufs[rank] = data;
+		barrier();
+		if (rank != 0) {
+			std::copy((const T*)bufs[0], (const T*)bufs[0] + len, data);
+		}
+		barrier();
+	}
+
+	void ReplicaGroup::barrier()
+	{
+		unique_lock<mutex> lock(m);
+		unsigned current = phase;
+		if (++arrived == n) {
+			arrived = 0;
+			phase++;
+			cv.notify_all();
+		}
+		else {
+			cv.wait(lock, [&] { return phase != current; });
+		}
+	}
+}
\ No newline at end of file
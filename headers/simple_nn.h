@@ -3,6 +3,7 @@
 #include "convolutional_layer.h"
 #include "max_pooling_layer.h"
 #include "average_pooling_layer.h"
+#include "global_average_pooling_layer.h"
 #include "activation_layer.h"
 #include "batch_normalization_1d_layer.h"
 #include "batch_normalization_2d_layer.h"
@@ -11,56 +12,329 @@
 #include "optimizers.h"
 #include "data_loader.h"
 #include "file_manage.h"
+#include "distributed.h"
+#include "memory_plan.h"
 
 namespace simple_nn
 {
+	// What SimpleNN::compile allocates for: training, or forward passes only (evaluate,
+	// fold_batchnorm), without deltas or gradients.
+	enum class CompileMode
+	{
+		TRAIN,
+		INFERENCE_ONLY
+	};
+
 	class SimpleNN
 	{
 	private:
 		vector<Layer*> net;
 		Optimizer* optim;
 		Loss* loss;
+		Layout layout;
+		bool inplace;
+		bool inference_only;
+		ThreadPool pool;
+		vector<int> in_shape;
+		VecXf arena;
+		size_t arena_bytes;
+		size_t unplanned_bytes;
+		MapXf input;
+		vector<Param> param_list;
+		int n_replicas;
+		vector<SimpleNN*> replicas;
+		ReplicaGroup group;
+		ProcessGroup* process_group;
+		GradientSync grad_sync;
+		bool is_replica;
 	public:
+		SimpleNN();
+		~SimpleNN();
 		void add(Layer* layer);
+		void set_layout(Layout layout);
+		void set_inplace(bool enable);
+		void set_threads(int n_threads);
+		void set_replicas(int n_replicas);
+		void set_process_group(ProcessGroup* process_group);
 		void compile(vector<int> input_shape, Optimizer* optim=nullptr, Loss* loss=nullptr);
+		void compile(vector<int> input_shape, CompileMode mode);
 		void fit(const DataLoader& train_loader, int epochs, const DataLoader& valid_loader);
 		void save(string save_dir, string fname);
 		void load(string save_dir, string fname);
 		void evaluate(const DataLoader& data_loader);
+		void fold_batchnorm(const DataLoader& check_loader, float tolerance = 1e-4f);
 	private:
+		void fuse_softmax_loss();
+		void fuse_activations();
+		void make_replicas(const vector<int>& input_shape);
+		void train_replicas(const MatXf& X, const VecXi& Y, float& loss_acc, float& error_acc);
+		void reduce_replica_grads();
+		void broadcast_params();
+		void plan_memory();
+		int fold_batchnorm_layers();
+		Layer* buffer_owner(int l);
 		void forward(const MatXf& X, bool is_training);
-		void classify(const MatXf& output, VecXi& classified);
+		void forward(const MatXf& X, bool is_training, int n_layers);
+		void predict(const MatXf& X, VecXi& classified);
+		void classify(const MapXf& output, VecXi& classified);
 		void error_criterion(const VecXi& classified, const VecXi& labels, float& error_acc);
-		void loss_criterion(const MatXf& output, const VecXi& labels, float& loss_acc);
+		void loss_criterion(const MapXf& output, const VecXi& labels, float& loss_acc);
 		void zero_grad();
-		void backward(const MatXf& X);
+		void backward();
 		void update_weight();
 		int count_params();
 		void write_or_read_params(fstream& fs, string mode);
 	};
 
+	SimpleNN::SimpleNN() : optim(nullptr), loss(nullptr), layout(Layout::NCHW), inplace(true), inference_only(false), arena_bytes(0),
+		unplanned_bytes(0), input(nullptr, 0, 0), n_replicas(1), process_group(nullptr), is_replica(false) {}
+
+	SimpleNN::~SimpleNN()
+	{
+		for (SimpleNN* r : replicas) delete r;
+		for (Layer* l : net) delete l;
+		delete loss;
+	}
+
 	void SimpleNN::add(Layer* layer) { net.push_back(layer); }
 
+	void SimpleNN::set_layout(Layout layout) { this->layout = layout; }
+
+	void SimpleNN::set_inplace(bool enable) { inplace = enable; }
+
+	// The layers split their batch, channel or spatial loops over n_threads threads (the calling
+	// one included). Layers size their per-thread buffers at compile, so call this before it.
+	void SimpleNN::set_threads(int n_threads) { pool.start(n_threads); }
+
+	// Data-parallel training: fit splits every batch into n_replicas equal shards, each run forward
+	// and backward by its own copy of the network on a thread of the pool (which is grown to
+	// n_replicas threads; the kernels of a replica run serially). The gradients of the replicas are
+	// summed in a fixed tree and applied once, with the learning rate scaled by the whole batch, and
+	// BatchNorm layers share their batch statistics; a step computes what one replica would on the
+	// whole batch, up to the order of the sums. Call this before compile.
+	void SimpleNN::set_replicas(int n_replicas) { this->n_replicas = n_replicas; }
+
+	// Distributed training: the processes of the group each fit their own shard of the data (see
+	// DataLoader::shard) and average their gradients after backward, overlapped with it (see
+	// GradientSync), so that each step applies the mean gradient of the batches of all processes.
+	// The weights start from those of rank 0. BatchNorm normalizes over the batch of each process;
+	// the moving statistics are averaged. Call this before compile.
+	void SimpleNN::set_process_group(ProcessGroup* process_group) { this->process_group = process_group; }
+
 	void SimpleNN::compile(vector<int> input_shape, Optimizer* optim, Loss* loss)
 	{
 		// set optimizer & loss
 		this->optim = optim;
 		this->loss = loss;
 
+		fuse_softmax_loss();
+		fuse_activations();
+
+		// replicas copy the fused layers before they are set (training only)
+		if (n_replicas > 1 && this->loss != nullptr) {
+			if (pool.size() < n_replicas) pool.start(n_replicas);
+			make_replicas(input_shape);
+		}
+
 		// set first & last layer
 		net.front()->is_first = true;
 		net.back()->is_last = true;
 
 		// set network
+		in_shape = input_shape;
 		for (int l = 0; l < net.size(); l++) {
+			net[l]->layout = layout;
+			net[l]->pool = &pool;
+			net[l]->inference_only = inference_only;
+
+			// hidden activations run on the buffers of the layer before them, unless that layer
+			// reads its own output in backward (an in-place or fused activation)
+			net[l]->in_place = false;
+			if (inplace && l > 0 && !net[l]->is_last && net[l]->supports_in_place() && !net[l - 1]->in_place) {
+				Linear* prev = dynamic_cast<Linear*>(net[l - 1]);
+				net[l]->in_place = prev == nullptr || prev->activation() == ActivType::NONE;
+			}
+
 			if (l == 0) net[l]->set_layer(input_shape);
 			else net[l]->set_layer(net[l - 1]->output_shape());
+
+			// swap in a compile-time specialized kernel if the configured shape has one
+			if (Layer* specialized = net[l]->specialize()) {
+				delete net[l];
+				net[l] = specialized;
+			}
+			if (inference_only) reshape(net[l]->delta, 0, 0);
+		}
+
+		// set Loss layer (the one fuse_softmax_loss may have replaced)
+		if (this->loss != nullptr) {
+			this->loss->set_layer(net.back()->output_shape());
+		}
+
+		plan_memory();
+		if (!is_replica) {
+			size_t before = unplanned_bytes;
+			size_t after = arena_bytes;
+			for (SimpleNN* r : replicas) {
+				before += r->unplanned_bytes;
+				after += r->arena_bytes;
+			}
+			cout << "Memory plan: " << fixed << setprecision(2) << before / 1048576.0 << " MB of activations and scratch";
+			cout << " -> " << after / 1048576.0 << " MB in one arena" << defaultfloat << endl;
 		}
 
-		// set Loss layer
-		if (loss != nullptr) {
-			loss->set_layer(net.back()->output_shape());
+		param_list.clear();
+		vector<vector<Param>> layer_params;
+		for (Layer* l : net) {
+			layer_params.push_back(l->params());
+			param_list.insert(param_list.end(), layer_params.back().begin(), layer_params.back().end());
 		}
+		if (process_group != nullptr && this->loss != nullptr) {
+			grad_sync.set(process_group, layer_params);
+		}
+	}
+
+	// For forward passes only: the layers allocate no delta or gradient state, and the outputs of
+	// the layers take turns in two regions of the arena, as only the input and the output of the
+	// running layer are live. Such a model can be loaded, folded and evaluated, not fitted.
+	void SimpleNN::compile(vector<int> input_shape, CompileMode mode)
+	{
+		inference_only = mode == CompileMode::INFERENCE_ONLY;
+		compile(input_shape);
+	}
+
+	// Each replica is a model of its own, compiled for a shard of the batch; its BatchNorm layers
+	// share their sums through group.
+	void SimpleNN::make_replicas(const vector<int>& input_shape)
+	{
+		assert(input_shape[0] % n_replicas == 0 && "SimpleNN::compile(...): The batch size must be a multiple of the number of replicas.");
+
+		vector<int> shard_shape = input_shape;
+		shard_shape[0] /= n_replicas;
+		group.set_size(n_replicas);
+
+		for (int k = 0; k < n_replicas; k++) {
+			SimpleNN* replica = new SimpleNN;
+			replica->is_replica = true;
+			for (const Layer* l : net) {
+				Layer* copy = l->clone();
+				assert(copy != nullptr && "SimpleNN::compile(...): A layer of the model cannot be replicated.");
+				replica->add(copy);
+			}
+			replica->set_layout(layout);
+			replica->set_inplace(inplace);
+			replica->compile(shard_shape, nullptr, loss->clone());
+
+			for (Layer* l : replica->net) {
+				if (BatchNorm1d* bn = dynamic_cast<BatchNorm1d*>(l)) bn->set_group(&group, k);
+				else if (BatchNorm2d* bn = dynamic_cast<BatchNorm2d*>(l)) bn->set_group(&group, k);
+			}
+			replicas.push_back(replica);
+		}
+	}
+
+	// Folds a Softmax output layer trained with CrossEntropyLoss into a SoftmaxCrossEntropyLoss,
+	// which takes the logits directly. The network then outputs logits, with the same argmax.
+	void SimpleNN::fuse_softmax_loss()
+	{
+		if (net.size() < 2 || dynamic_cast<Softmax*>(net.back()) == nullptr) return;
+		if (dynamic_cast<CrossEntropyLoss*>(loss) == nullptr) return;
+
+		delete loss;
+		loss = new SoftmaxCrossEntropyLoss;
+		delete net.back();
+		net.pop_back();
+	}
+
+	// Folds a ReLU or Tanh that follows a Linear into the Linear's output pass.
+	void SimpleNN::fuse_activations()
+	{
+		for (int l = 0; l + 1 < (int)net.size(); l++) {
+			Linear* linear = dynamic_cast<Linear*>(net[l]);
+			if (linear == nullptr || linear->activation() != ActivType::NONE) continue;
+
+			ActivType activ = ActivType::NONE;
+			if (dynamic_cast<ReLU*>(net[l + 1]) != nullptr) activ = ActivType::RELU;
+			else if (dynamic_cast<Tanh*>(net[l + 1]) != nullptr) activ = ActivType::TANH;
+			if (activ == ActivType::NONE) continue;
+
+			linear->set_activation(activ);
+			linear->is_last = net[l + 1]->is_last;
+			delete net[l + 1];
+			net.erase(net.begin() + l + 1);
+		}
+	}
+
+	// Inference only: folds every BatchNorm that directly follows a Conv2d or a Linear (without a
+	// fused activation) into its weights and bias and removes it from the network, then fuses the
+	// activations the removal made adjacent to a Linear. The moving statistics are used, so the
+	// network must not be trained afterwards. The outputs on the first batch of check_loader (if
+	// any) before and after folding must agree within tolerance.
+	void SimpleNN::fold_batchnorm(const DataLoader& check_loader, float tolerance)
+	{
+		bool check = check_loader.size() != 0;
+		MatXf X;
+		MatXf reference;
+		if (check) {
+			X = check_loader.get_x(0);
+			forward(X, false);
+			reference = net.back()->output;
+		}
+
+		int folded = fold_batchnorm_layers();
+		if (folded == 0) return;
+		plan_memory();
+		cout << folded << " BatchNorm layer(s) folded." << endl;
+		if (!check) return;
+
+		forward(X, false);
+		const MapXf& output = net.back()->output;
+		float max_diff = (output - reference).cwiseAbs().maxCoeff();
+
+		VecXi before(output.rows());
+		VecXi after(output.rows());
+		classify(MapXf(reference.data(), reference.rows(), reference.cols()), before);
+		classify(output, after);
+		int changed = (int)(before.array() != after.array()).count();
+
+		cout << "Folding check: max |diff| = " << scientific << max_diff << defaultfloat;
+		cout << ", " << changed << "/" << before.size() << " predictions changed." << endl;
+		if (!(max_diff <= tolerance)) {
+			cout << "Folded outputs exceed the tolerance of " << tolerance << "." << endl;
+			exit(1);
+		}
+	}
+
+	int SimpleNN::fold_batchnorm_layers()
+	{
+		int folded = 0;
+		for (int l = 1; l < (int)net.size(); l++) {
+			BatchNorm1d* bn1d = dynamic_cast<BatchNorm1d*>(net[l]);
+			BatchNorm2d* bn2d = dynamic_cast<BatchNorm2d*>(net[l]);
+			Linear* linear = dynamic_cast<Linear*>(net[l - 1]);
+			Conv2d* conv = dynamic_cast<Conv2d*>(net[l - 1]);
+
+			if (bn1d != nullptr && linear != nullptr && linear->activation() == ActivType::NONE) {
+				bn1d->fold_into(linear->W, linear->b.data());
+			}
+			else if (bn2d != nullptr && conv != nullptr) {
+				bn2d->fold_into(conv->kernel, conv->bias.data());
+			}
+			else {
+				continue;
+			}
+
+			// a layer that ran in place on the BatchNorm's buffers now runs on its predecessor's,
+			// which have the same shape
+			net[l - 1]->is_last = net[l]->is_last;
+			delete net[l];
+			net.erase(net.begin() + l);
+			l--;
+			folded++;
+		}
+
+		if (folded > 0) fuse_activations();
+		return folded;
 	}
 
 	void SimpleNN::fit(const DataLoader& train_loader, int epochs, const DataLoader& valid_loader)
@@ -77,6 +351,15 @@ namespace simple_nn
 		VecXi Y;
 		VecXi classified(batch);
 
+		// processes start from the weights of rank 0, replicas from those of the model; only
+		// rank 0 reports
+		bool report = true;
+		if (process_group != nullptr) {
+			for (const Param& p : param_list) process_group->broadcast(p.value, p.size);
+			report = process_group->rank() == 0;
+		}
+		broadcast_params();
+
 		for (int e = 0; e < epochs; e++) {
 			float loss = 0.f;
 			float error = 0.f;
@@ -86,15 +369,22 @@ namespace simple_nn
 				X = train_loader.get_x(n);
 				Y = train_loader.get_y(n);
 
-				forward(X, true);
-				classify(net.back()->output, classified);
-				error_criterion(classified, Y, error);
+				if (replicas.empty()) {
+					forward(X, true);
+					classify(net.back()->output, classified);
+					error_criterion(classified, Y, error);
 
-				zero_grad();
-				loss_criterion(net.back()->output, Y, loss);
-				backward(X);
-				update_weight();
+					zero_grad();
+					loss_criterion(net.back()->output, Y, loss);
+					backward();
+					if (process_group != nullptr) grad_sync.wait();
+					update_weight();
+				}
+				else {
+					train_replicas(X, Y, loss, error);
+				}
 
+				if (!report) continue;
 				cout << "[Epoch:" << setw(3) << e + 1 << "/" << epochs << ", ";
 				cout << "Batch: " << setw(4) << n + 1 << "/" << n_batch << "]";
 
@@ -105,6 +395,16 @@ namespace simple_nn
 			system_clock::time_point end = system_clock::now();
 			duration<float> sec = end - start;
 
+			float wait_sec = 0.f;
+			if (process_group != nullptr) {
+				float sums[2] = { loss, error };
+				process_group->all_reduce(sums, 2);
+				loss = sums[0] / process_group->size();
+				error = sums[1] / process_group->size();
+				wait_sec = grad_sync.take_wait_time();
+			}
+			if (!report) continue;
+
 			float loss_valid = 0.f;
 			float error_valid = 0.f;
 
@@ -129,19 +429,192 @@ namespace simple_nn
 				cout << " - loss(valid): " << loss_valid / n_batch_valid;
 				cout << " - error(valid): " << error_valid / n_batch_valid * 100 << "%";
 			}
+			if (process_group != nullptr) {
+				// images per second over all processes; compared with that of one process times
+				// world_size, it gives the scaling efficiency. The time waiting for gradients is
+				// the communication backward did not hide.
+				int world = process_group->size();
+				cout << " - " << setprecision(0) << (float)batch * n_batch * world / sec.count() << " img/s";
+				cout << " (" << world << " processes, comm wait: " << setprecision(2) << wait_sec << "s)";
+			}
 			cout << endl;
 		}
 	}
 
+	// One step of data-parallel training: the replicas run their shards on the pool, their
+	// gradients are summed into the model's, the model takes one step and its weights are copied
+	// back to the replicas. The loss and error are the means over the shards.
+	void SimpleNN::train_replicas(const MatXf& X, const VecXi& Y, float& loss_acc, float& error_acc)
+	{
+		int K = (int)replicas.size();
+		int rows = (int)X.rows() / K;
+		int shard = (int)Y.size() / K;
+		vector<float> loss_part(K, 0.f);
+		vector<float> error_part(K, 0.f);
+
+		pool.run(K, [&](int k0, int k1, int t) {
+			for (int k = k0; k < k1; k++) {
+				SimpleNN* r = replicas[k];
+				MatXf x = X.middleRows(rows * k, rows);
+				VecXi y = Y.segment(shard * k, shard);
+				VecXi classified(shard);
+
+				r->forward(x, true);
+				r->classify(r->net.back()->output, classified);
+				r->error_criterion(classified, y, error_part[k]);
+
+				r->zero_grad();
+				r->loss_criterion(r->net.back()->output, y, loss_part[k]);
+				r->backward();
+			}
+		});
+
+		reduce_replica_grads();
+		if (process_group != nullptr) grad_sync.wait();
+		update_weight();
+		broadcast_params();
+
+		for (int k = 0; k < K; k++) {
+			loss_acc += loss_part[k] / K;
+			error_acc += error_part[k] / K;
+		}
+	}
+
+	// Sums the gradients of the replicas pairwise (k += k + s for s = 1, 2, 4, ...), the pairs of a
+	// round in parallel, and copies the total of replica 0 to the model, with the moving statistics
+	// of BatchNorm, which every replica computed from the same sums.
+	void SimpleNN::reduce_replica_grads()
+	{
+		int K = (int)replicas.size();
+		for (int s = 1; s < K; s *= 2) {
+			int pairs = (K - s + 2 * s - 1) / (2 * s);
+			pool.run(pairs, [&](int p0, int p1, int t) {
+				for (int p = p0; p < p1; p++) {
+					const vector<Param>& dst = replicas[2 * s * p]->param_list;
+					const vector<Param>& src = replicas[2 * s * p + s]->param_list;
+					for (int i = 0; i < (int)dst.size(); i++) {
+						if (dst[i].grad == nullptr) continue;
+						Map<VecXf>(dst[i].grad, dst[i].size) += Map<const VecXf>(src[i].grad, src[i].size);
+					}
+				}
+			});
+		}
+
+		const vector<Param>& total = replicas[0]->param_list;
+		for (int i = 0; i < (int)param_list.size(); i++) {
+			const Param& p = param_list[i];
+			if (p.grad == nullptr) std::copy(total[i].value, total[i].value + p.size, p.value);
+			else std::copy(total[i].grad, total[i].grad + p.size, p.grad);
+		}
+	}
+
+	// Copies the parameters of the model to every replica.
+	void SimpleNN::broadcast_params()
+	{
+		pool.run((int)replicas.size(), [&](int k0, int k1, int t) {
+			for (int k = k0; k < k1; k++) {
+				const vector<Param>& dst = replicas[k]->param_list;
+				for (int i = 0; i < (int)param_list.size(); i++) {
+					std::copy(param_list[i].value, param_list[i].value + param_list[i].size, dst[i].value);
+				}
+			}
+		});
+	}
+
+	// Places the input and the output, delta and scratch buffers of every layer in one arena (see
+	// MemoryPlan). With n layers, step l runs forward of layer l, step n the loss and step 2n - l
+	// backward of layer l; a buffer is live from the step that first writes it to the last that
+	// reads it, and buffers never live at the same step share memory. The output of a layer is
+	// kept from its forward to its backward, or without backward until the next layer that does
+	// not run in place on it has read it; scratch then only lives during its layer's forward.
+	void SimpleNN::plan_memory()
+	{
+		int n = (int)net.size();
+		vector<Buffer> buffers;
+		MemoryPlan plan;
+		auto add = [&](const Buffer& b, const vector<pair<int, int>>& live) {
+			if (b.bytes == 0) return;
+			buffers.push_back(b);
+			plan.add(b.bytes, live);
+		};
+
+		if (layout == Layout::NHWC && in_shape.size() == 4) reshape(input, in_shape[0] * in_shape[2] * in_shape[3], in_shape[1]);
+		else if (in_shape.size() == 4) reshape(input, in_shape[0] * in_shape[1], in_shape[2] * in_shape[3]);
+		else reshape(input, in_shape[0], in_shape[1]);
+		add(make_buffer(input, Lifetime::STEP), { { 0, inference_only ? 0 : 2 * n } });
+
+		for (int l = 0; l < n; l++) {
+			// the delta of a layer is written by the backward of the first layer after it that
+			// does not run in place (or the loss), and in-place layers have no buffers of their own
+			int e = l;
+			while (e + 1 < n && net[e + 1]->in_place) e++;
+			if (inference_only) {
+				add(make_buffer(net[l]->output, Lifetime::STEP), { { l, e + 1 } });
+				for (const Buffer& b : net[l]->buffers()) add(b, { { l, l } });
+				continue;
+			}
+			add(make_buffer(net[l]->output, Lifetime::STEP), { { l, 2 * n - l } });
+			add(make_buffer(net[l]->delta, Lifetime::STEP), { { e + 1 < n ? 2 * n - e - 1 : n, 2 * n - l } });
+
+			for (const Buffer& b : net[l]->buffers()) {
+				if (b.lifetime == Lifetime::STEP) add(b, { { l, 2 * n - l } });
+				else add(b, { { l, l }, { 2 * n - l, 2 * n - l } });
+			}
+		}
+		plan.plan();
+
+		// the arena is over-allocated by a block so that its start can be aligned
+		arena.resize((plan.size() + ARENA_ALIGN) / sizeof(float));
+		char* base = (char*)(((uintptr_t)arena.data() + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN);
+		for (int b = 0; b < (int)buffers.size(); b++) {
+			buffers[b].place(base + plan.offset(b));
+		}
+		arena_bytes = plan.size();
+		unplanned_bytes = plan.unplanned_size();
+	}
+
+	// Returns the layer whose output and delta layer l uses: the previous one for in-place layers.
+	Layer* SimpleNN::buffer_owner(int l)
+	{
+		return net[l]->in_place ? net[l - 1] : net[l];
+	}
+
 	void SimpleNN::forward(const MatXf& X, bool is_training)
 	{
-		for (int l = 0; l < net.size(); l++) {
-			if (l == 0) net[l]->forward(X, is_training);
-			else net[l]->forward(net[l - 1]->output, is_training);
+		forward(X, is_training, (int)net.size());
+	}
+
+	// Runs the first n_layers layers only. Data loaders yield NCHW batches; a channels-last
+	// network converts its input as it copies it to the arena.
+	void SimpleNN::forward(const MatXf& X, bool is_training, int n_layers)
+	{
+		if (layout == Layout::NHWC && in_shape.size() == 4) {
+			int ch = in_shape[1];
+			nchw_to_nhwc(X, (int)X.rows() / ch, ch, in_shape[2] * in_shape[3], input);
+		}
+		else {
+			input = X;
+		}
+
+		for (int l = 0; l < n_layers; l++) {
+			if (net[l]->in_place) net[l]->forward_in_place(buffer_owner(l)->output);
+			else if (l == 0) net[l]->forward(input, is_training);
+			else net[l]->forward(buffer_owner(l - 1)->output, is_training);
 		}
 	}
 
-	void SimpleNN::classify(const MatXf& output, VecXi& classified)
+	// Classifies a batch in evaluation mode. A Softmax output layer does not change the row-wise
+	// argmax, so it is not run and the argmax is taken over its input.
+	void SimpleNN::predict(const MatXf& X, VecXi& classified)
+	{
+		int n_layers = (int)net.size();
+		if (n_layers > 1 && dynamic_cast<Softmax*>(net.back()) != nullptr) n_layers--;
+
+		forward(X, false, n_layers);
+		classify(buffer_owner(n_layers - 1)->output, classified);
+	}
+
+	void SimpleNN::classify(const MapXf& output, VecXi& classified)
 	{
 		// assume that the last layer is linear, not 2d.
 		assert(output.rows() == classified.size());
@@ -162,26 +635,37 @@ namespace simple_nn
 		error_acc += error / batch;
 	}
 
-	void SimpleNN::loss_criterion(const MatXf& output, const VecXi& labels, float& loss_acc)
+	void SimpleNN::loss_criterion(const MapXf& output, const VecXi& labels, float& loss_acc)
 	{
 		loss_acc += loss->calc_loss(output, labels, net.back()->delta);
 	}
 
 	void SimpleNN::zero_grad()
 	{
-		for (const auto& l : net) l->zero_grad();
+		for (const auto& l : net) {
+			l->zero_grad();
+		}
 	}
 
-	void SimpleNN::backward(const MatXf& X)
+	// A delta shares the arena with buffers dead by then, so it is zeroed just before the layer
+	// that writes it.
+	void SimpleNN::backward()
 	{
 		for (int l = (int)net.size() - 1; l >= 0; l--) {
-			if (l == 0) {
-				MatXf empty;
-				net[l]->backward(X, empty);
+			if (net[l]->in_place) {
+				Layer* owner = buffer_owner(l);
+				net[l]->backward_in_place(owner->output, owner->delta);
+			}
+			else if (l == 0) {
+				MapXf empty(nullptr, 0, 0);
+				net[l]->backward(input, empty);
 			}
 			else {
-				net[l]->backward(net[l - 1]->output, net[l - 1]->delta);
+				Layer* prev = buffer_owner(l - 1);
+				prev->delta.setZero();
+				net[l]->backward(prev->output, prev->delta);
 			}
+			if (process_group != nullptr) grad_sync.layer_done(l);
 		}
 	}
 
@@ -189,6 +673,9 @@ namespace simple_nn
 	{
 		float lr = optim->lr();
 		float decay = optim->decay();
+		// the layers scale decay by their own batch; averaged gradients stand for the batches of all
+		// processes
+		if (process_group != nullptr) decay /= process_group->size();
 		for (const auto& l : net) {
 			l->update_weight(lr, decay);
 		}
@@ -274,7 +761,7 @@ namespace simple_nn
 
 	void SimpleNN::write_or_read_params(fstream& fs, string mode)
 	{
-		for (const Layer* l : net) {
+		for (Layer* l : net) {
 			if (l->type == LayerType::LINEAR) {
 				const Linear* lc = dynamic_cast<const Linear*>(l);
 				int s1 = (int)lc->W.size();
@@ -289,16 +776,19 @@ namespace simple_nn
 				}
 			}
 			else if (l->type == LayerType::CONV2D) {
-				const Conv2d* lc = dynamic_cast<const Conv2d*>(l);
-				int s1 = (int)lc->kernel.size();
+				// kernels are stored in the NCHW order, so a model loads in either layout
+				Conv2d* lc = dynamic_cast<Conv2d*>(l);
 				int s2 = (int)lc->bias.size();
 				if (mode == "write") {
-					fs.write((char*)lc->kernel.data(), sizeof(float) * s1);
+					MatXf kernel = lc->reorder_kernel(lc->kernel, layout, Layout::NCHW);
+					fs.write((char*)kernel.data(), sizeof(float) * kernel.size());
 					fs.write((char*)lc->bias.data(), sizeof(float) * s2);
 				}
 				else {
-					fs.read((char*)lc->kernel.data(), sizeof(float) * s1);
+					MatXf kernel(lc->kernel.rows(), lc->kernel.cols());
+					fs.read((char*)kernel.data(), sizeof(float) * kernel.size());
 					fs.read((char*)lc->bias.data(), sizeof(float) * s2);
+					lc->kernel = lc->reorder_kernel(kernel, Layout::NCHW, layout);
 				}
 			}
 			else if (l->type == LayerType::BATCHNORM1D) {
@@ -360,8 +850,7 @@ namespace simple_nn
 			MatXf X = data_loader.get_x(n);
 			VecXi Y = data_loader.get_y(n);
 
-			forward(X, false);
-			classify(net.back()->output, classified);
+			predict(X, classified);
 			error_criterion(classified, Y, error_acc);
 			
 			cout << "[Batch: " << setw(3) << n + 1 << "/" << n_batch << "]";
@@ -0,0 +1,118 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "common.h"
+
+namespace simple_nn
+{
+	// A fixed set of worker threads for the intra-op loops of the layers. run(n, f, grain) splits
+	// [0, n) into one contiguous range per thread (on multiples of grain) and calls f(begin, end, t)
+	// once for every t < size(), the calling thread taking t = 0; ranges may be empty when there is
+	// too little work. It returns when every range is done. The split depends only on n, grain and
+	// the number of threads, so per-thread partial sums added up in order of t give the same
+	// result on every run.
+	class ThreadPool
+	{
+	private:
+		vector<thread> workers;
+		mutex m;
+		condition_variable start_cv;
+		condition_variable done_cv;
+		std::function<void(int)> task;
+		unsigned generation;
+		int pending;
+		bool stop;
+	public:
+		ThreadPool();
+		~ThreadPool();
+		void start(int n_threads);
+		int size() const;
+		template<typename F>
+		void run(int n, const F& f, int grain = 1);
+	private:
+		void join();
+		void work(int t, unsigned seen);
+	};
+
+	ThreadPool::ThreadPool() : generation(0), pending(0), stop(false) {}
+
+	ThreadPool::~ThreadPool() { join(); }
+
+	void ThreadPool::start(int n_threads)
+	{
+		join();
+		// Eigen sets up its GEMM blocking parameters on first use; do it before any thread does
+		Eigen::initParallel();
+		stop = false;
+		for (int t = 1; t < n_threads; t++) {
+			workers.emplace_back(&ThreadPool::work, this, t, generation);
+		}
+	}
+
+	int ThreadPool::size() const { return (int)workers.size() + 1; }
+
+	template<typename F>
+	void ThreadPool::run(int n, const F& f, int grain)
+	{
+		int units = (n + grain - 1) / grain;
+		int chunks = std::min(size(), units);
+		if (chunks <= 1) {
+			f(0, n, 0);
+			for (int t = 1; t < size(); t++) f(n, n, t);
+			return;
+		}
+
+		auto range = [&](int t) {
+			if (t >= chunks) {
+				f(n, n, t);
+				return;
+			}
+			int begin = grain * (int)((long long)units * t / chunks);
+			int end = grain * (int)((long long)units * (t + 1) / chunks);
+			f(begin, std::min(end, n), t);
+		};
+
+		{
+			lock_guard<mutex> lock(m);
+			task = range;
+			pending = (int)workers.size();
+			generation++;
+		}
+		start_cv.notify_all();
+		range(0);
+
+		unique_lock<mutex> lock(m);
+		done_cv.wait(lock, [&] { return pending == 0; });
+		task = nullptr;
+	}
+
+	void ThreadPool::join()
+	{
+		{
+			lock_guard<mutex> lock(m);
+			stop = true;
+		}
+		start_cv.notify_all();
+		for (thread& w : workers) w.join();
+		workers.clear();
+	}
+
+	void ThreadPool::work(int t, unsigned seen)
+	{
+		while (true) {
+			{
+				unique_lock<mutex> lock(m);
+				start_cv.wait(lock, [&] { return stop || generation != seen; });
+				if (stop) return;
+				seen = generation;
+			}
+			// task is not replaced before every worker has reported back
+			task(t);
+			{
+				lock_guard<mutex> lock(m);
+				if (--pending == 0) done_cv.notify_one();
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,274 @@
+#pragma once
+#include "common.h"
+
+namespace simple_nn
+{
+	// Transform matrices of the Winograd minimal filtering algorithm F(m x m, r x r)
+	// (Lavin & Gray, "Fast Algorithms for Convolutional Neural Networks", 2015).
+	// Supported: F(2x2, 3x3), F(4x4, 3x3) and F(2x2, 5x5).
+	struct WinogradTile
+	{
+		int m;
+		int r;
+		int alpha;
+		vector<float> AT; // m x alpha
+		vector<float> G;  // alpha x r
+		vector<float> BT; // alpha x alpha
+	};
+
+	bool winograd_supported(int m, int r)
+	{
+		return (r == 3 && (m == 2 || m == 4)) || (r == 5 && m == 2);
+	}
+
+	WinogradTile winograd_tile(int m, int r)
+	{
+		assert(winograd_supported(m, r) && "winograd_tile(int, int): Unsupported tile.");
+
+		WinogradTile t;
+		t.m = m;
+		t.r = r;
+		t.alpha = m + r - 1;
+
+		if (m == 2 && r == 3) {
+			// interpolation points: 0, 1, -1, inf
+			t.AT = {
+				1, 1, 1, 0,
+				0, 1, -1, -1
+			};
+			t.G = {
+				1, 0, 0,
+				0.5f, 0.5f, 0.5f,
+				0.5f, -0.5f, 0.5f,
+				0, 0, 1
+			};
+			t.BT = {
+				1, 0, -1, 0,
+				0, 1, 1, 0,
+				0, -1, 1, 0,
+				0, 1, 0, -1
+			};
+			return t;
+		}
+
+		// F(4x4, 3x3) and F(2x2, 5x5) share alpha = 6 and the points 0, 1, -1, 2, -2, inf
+		t.BT = {
+			4, 0, -5, 0, 1, 0,
+			0, -4, -4, 1, 1, 0,
+			0, 4, -4, -1, 1, 0,
+			0, -2, -1, 2, 1, 0,
+			0, 2, -1, -2, 1, 0,
+			0, 4, 0, -5, 0, 1
+		};
+
+		if (r == 3) {
+			t.AT = {
+				1, 1, 1, 1, 1, 0,
+				0, 1, -1, 2, -2, 0,
+				0, 1, 1, 4, 4, 0,
+				0, 1, -1, 8, -8, 1
+			};
+			t.G = {
+				1 / 4.f, 0, 0,
+				-1 / 6.f, -1 / 6.f, -1 / 6.f,
+				-1 / 6.f, 1 / 6.f, -1 / 6.f,
+				1 / 24.f, 1 / 12.f, 1 / 6.f,
+				1 / 24.f, -1 / 12.f, 1 / 6.f,
+				0, 0, 1
+			};
+		}
+		else {
+			t.AT = {
+				1, 1, 1, 1, 1, 0,
+				0, 1, -1, 2, -2, 1
+			};
+			t.G = {
+				1 / 4.f, 0, 0, 0, 0,
+				-1 / 6.f, -1 / 6.f, -1 / 6.f, -1 / 6.f, -1 / 6.f,
+				-1 / 6.f, 1 / 6.f, -1 / 6.f, 1 / 6.f, -1 / 6.f,
+				1 / 24.f, 1 / 12.f, 1 / 6.f, 1 / 3.f, 2 / 3.f,
+				1 / 24.f, -1 / 12.f, 1 / 6.f, -1 / 3.f, 2 / 3.f,
+				0, 0, 0, 0, 1
+			};
+		}
+		return t;
+	}
+
+	// out (rows x rows) = L (rows x k) * d (k x k) * L^T
+	void winograd_transform(const float* L, int rows, int k, const float* d, float* out)
+	{
+		float tmp[64];
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < k; j++) {
+				float sum = 0.f;
+				for (int l = 0; l < k; l++) {
+					sum += L[i * k + l] * d[l * k + j];
+				}
+				tmp[i * k + j] = sum;
+			}
+		}
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < rows; j++) {
+				float sum = 0.f;
+				for (int l = 0; l < k; l++) {
+					sum += tmp[i * k + l] * L[j * k + l];
+				}
+				out[i * rows + j] = sum;
+			}
+		}
+	}
+
+	// Same as winograd_transform, applied to n tiles at once. Element e of tile t is
+	// src[e][t] and dst[e][t], so the innermost loops run over contiguous tiles.
+	// tmp must hold rows * k * n floats.
+	void winograd_transform_tiles(const float* L, int rows, int k, const float* const* src,
+		float* const* dst, int n, float* tmp)
+	{
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < k; j++) {
+				Map<RowVecXf> t(tmp + (i * k + j) * n, n);
+				t.setZero();
+				for (int l = 0; l < k; l++) {
+					float coef = L[i * k + l];
+					if (coef == 0.f) continue;
+					t += coef * Map<const RowVecXf>(src[l * k + j], n);
+				}
+			}
+		}
+		for (int i = 0; i < rows; i++) {
+			for (int j = 0; j < rows; j++) {
+				Map<RowVecXf> d(dst[i * rows + j], n);
+				d.setZero();
+				for (int l = 0; l < k; l++) {
+					float coef = L[j * k + l];
+					if (coef == 0.f) continue;
+					d += coef * Map<const RowVecXf>(tmp + (i * k + l) * n, n);
+				}
+			}
+		}
+	}
+
+	// Transforms an (oc x ic*r*r) kernel into alpha*alpha stacked (oc x ic) matrices.
+	// If flip is set, the transposed and 180-degree rotated kernel is transformed instead,
+	// i.e. alpha*alpha stacked (ic x oc) matrices used to propagate gradients.
+	void winograd_filter_transform(const MatXf& kernel, int oc, int ic, const WinogradTile& t,
+		bool flip, MatXf& U)
+	{
+		int r = t.r;
+		int aa = t.alpha * t.alpha;
+		int rows = flip ? ic : oc;
+		int cols = flip ? oc : ic;
+		float g[25];
+		float u[64];
+
+		U.resize(aa * rows, cols);
+		for (int o = 0; o < oc; o++) {
+			for (int c = 0; c < ic; c++) {
+				const float* k = kernel.data() + kernel.cols() * o + r * r * c;
+				for (int i = 0; i < r * r; i++) {
+					g[i] = flip ? k[r * r - 1 - i] : k[i];
+				}
+				winograd_transform(t.G.data(), t.alpha, r, g, u);
+				for (int xi = 0; xi < aa; xi++) {
+					if (flip) U(xi * rows + c, o) = u[xi];
+					else U(xi * rows + o, c) = u[xi];
+				}
+			}
+		}
+	}
+
+	// Stride-1 convolution of a batch of (channels x height x width) images with the
+	// transformed filters U, accumulated into out (out_channels x out_h x out_w per image).
+	// Images are processed sub_batch at a time; V and M must hold at least
+	// alpha^2 * channels and alpha^2 * out_channels rows of sub_batch * tiles columns.
+	void winograd_conv(const float* im, int batch, int channels, int height, int width, int pad,
+		const MatXf& U, int out_channels, int out_h, int out_w, const WinogradTile& t,
+		int sub_batch, float* V, float* M, float* out)
+	{
+		int m = t.m;
+		int a = t.alpha;
+		int aa = a * a;
+		int th = (out_h + m - 1) / m;
+		int tw = (out_w + m - 1) / m;
+		int tiles = th * tw;
+		int ihw = height * width;
+		int ohw = out_h * out_w;
+
+		// the tiles of one channel across the whole sub-batch are transformed at once
+		vector<float> buf(aa * sub_batch * tiles);
+		vector<float> tmp(aa * sub_batch * tiles);
+		vector<const float*> src(aa);
+		vector<float*> dst(aa);
+
+		for (int n0 = 0; n0 < batch; n0 += sub_batch) {
+			int nb = std::min(sub_batch, batch - n0);
+			int cols = nb * tiles;
+
+			// V[xi][c][tile] = (BT * d * B)[xi]
+			for (int c = 0; c < channels; c++) {
+				for (int i = 0; i < a; i++) {
+					for (int j = 0; j < a; j++) {
+						// tiles [tx_lo, tx_hi) of a row read inside the image
+						int tx_lo, tx_hi;
+						im2col_valid_range(width, tw, m, j - pad, tx_lo, tx_hi);
+						for (int s = 0; s < nb; s++) {
+							const float* im_c = im + ihw * (c + channels * (n0 + s));
+							float* d = buf.data() + (i * a + j) * cols + tiles * s;
+							for (int ty = 0; ty < th; ty++) {
+								int yy = ty * m - pad + i;
+								float* d_row = d + ty * tw;
+								if (yy < 0 || yy >= height) {
+									std::fill(d_row, d_row + tw, 0.f);
+									continue;
+								}
+								const float* im_row = im_c + yy * width - pad + j;
+								std::fill(d_row, d_row + tx_lo, 0.f);
+								for (int tx = tx_lo; tx < tx_hi; tx++) {
+									d_row[tx] = im_row[tx * m];
+								}
+								std::fill(d_row + tx_hi, d_row + tw, 0.f);
+							}
+						}
+					}
+				}
+				for (int xi = 0; xi < aa; xi++) {
+					src[xi] = buf.data() + xi * cols;
+					dst[xi] = V + (xi * channels + c) * cols;
+				}
+				winograd_transform_tiles(t.BT.data(), a, a, src.data(), dst.data(), cols, tmp.data());
+			}
+
+			// M[xi] = U[xi] * V[xi]
+			for (int xi = 0; xi < aa; xi++) {
+				Map<MatXf> Vx(V + xi * channels * cols, channels, cols);
+				Map<MatXf> Mx(M + xi * out_channels * cols, out_channels, cols);
+				Mx.noalias() = U.block(xi * out_channels, 0, out_channels, channels) * Vx;
+			}
+
+			// out += AT * M * A
+			for (int o = 0; o < out_channels; o++) {
+				for (int xi = 0; xi < aa; xi++) {
+					src[xi] = M + (xi * out_channels + o) * cols;
+				}
+				for (int e = 0; e < m * m; e++) {
+					dst[e] = buf.data() + e * cols;
+				}
+				winograd_transform_tiles(t.AT.data(), m, a, src.data(), dst.data(), cols, tmp.data());
+				for (int s = 0; s < nb; s++) {
+					float* out_o = out + ohw * (o + out_channels * (n0 + s));
+					for (int i = 0; i < m; i++) {
+						for (int j = 0; j < m; j++) {
+							const float* y = buf.data() + (i * m + j) * cols + tiles * s;
+							for (int ty = 0; ty < th && ty * m + i < out_h; ty++) {
+								float* o_row = out_o + (ty * m + i) * out_w + j;
+								for (int tx = 0; tx < tw && tx * m + j < out_w; tx++) {
+									o_row[tx * m] += y[ty * tw + tx];
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
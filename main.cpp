@@ -18,11 +18,16 @@ int main(int argc, char** argv)
 	VecXi train_Y, test_Y;
 
 	DataLoader train_loader, test_loader;
+	ProcessGroup group;
 
 	if (cfg.mode == "train") {
 		train_X = read_mnist(cfg.data_dir, "train-images.idx3-ubyte", n_train);
 		train_Y = read_mnist_label(cfg.data_dir, "train-labels.idx1-ubyte", n_train);
 		train_loader.load(train_X, train_Y, cfg.batch, ch, h, w, cfg.shuffle_train);
+		if (cfg.world_size > 1) {
+			group.init(cfg.rank, cfg.world_size, cfg.master_addr);
+			train_loader.shard(group.rank(), group.size(), group.seed());
+		}
 	}
 
 	test_X = read_mnist(cfg.data_dir, "t10k-images.idx3-ubyte", n_test);
@@ -33,6 +38,12 @@ int main(int argc, char** argv)
 
 	SimpleNN model;
 	load_model(cfg, model);
+	model.set_layout(cfg.layout == "nhwc" ? Layout::NHWC : Layout::NCHW);
+	model.set_threads(cfg.threads);
+	model.set_replicas(cfg.replicas);
+	if (cfg.world_size > 1) {
+		model.set_process_group(&group);
+	}
 
 	cout << "Model construction completed." << endl;
 
@@ -44,11 +55,14 @@ int main(int argc, char** argv)
 			model.compile({ cfg.batch, ch, h, w }, new SGD(cfg.lr, cfg.decay), new MSELoss);
 		}
 		model.fit(train_loader, cfg.epoch, test_loader);
-		model.save("./model_zoo", cfg.model + ".pth");
+		if (group.rank() == 0) {
+			model.save("./model_zoo", cfg.model + ".pth");
+		}
 	}
 	else {
-		model.compile({ cfg.batch, ch, h, w });
+		model.compile({ cfg.batch, ch, h, w }, CompileMode::INFERENCE_ONLY);
 		model.load(cfg.save_dir, cfg.pretrained);
+		model.fold_batchnorm(test_loader);
 		model.evaluate(test_loader);
 	}
 
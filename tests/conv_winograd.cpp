@@ -0,0 +1,139 @@
+// Compares the Winograd engine of Conv2d with IM2COL on the forward pass and the input gradient.
+// Build and run from the project directory:
+//   g++ tests/conv_winograd.cpp --std=c++17 -I ../include -O2 -pthread -o conv_winograd && ./conv_winograd
+// The Winograd transforms round differently from the direct sum, so the outputs are compared
+// relative to their largest magnitude; the errors stay below 1e-5.
+#include "../headers/simple_nn.h"
+using namespace std;
+using namespace simple_nn;
+using namespace Eigen;
+
+const float TOLERANCE = 1e-4f;
+
+struct Case
+{
+	ConvAlgo algo;
+	int in_channels;
+	int out_channels;
+	int kernel_size;
+	int padding;
+	int height;
+	int width;
+	size_t workspace;	// small limits split the batch into several Winograd chunks
+};
+
+// Places output, delta and the scratch buffers of a set layer in memory of its own.
+vector<float> place_buffers(Layer& l)
+{
+	vector<Buffer> bufs = l.buffers();
+	bufs.push_back(make_buffer(l.output, Lifetime::STEP));
+	bufs.push_back(make_buffer(l.delta, Lifetime::STEP));
+
+	size_t total = 0;
+	for (const Buffer& b : bufs) total += (b.bytes + sizeof(float) - 1) / sizeof(float);
+	vector<float> mem(total);
+
+	size_t offset = 0;
+	for (const Buffer& b : bufs) {
+		b.place((char*)(mem.data() + offset));
+		offset += (b.bytes + sizeof(float) - 1) / sizeof(float);
+	}
+	return mem;
+}
+
+void fill_random(float* data, Index size, default_random_engine& e)
+{
+	normal_distribution<float> dist(0.f, 1.f);
+	for (Index i = 0; i < size; i++) data[i] = dist(e);
+}
+
+float relative_error(const MatXf& a, const MatXf& b)
+{
+	return (a - b).cwiseAbs().maxCoeff() / std::max(b.cwiseAbs().maxCoeff(), 1e-30f);
+}
+
+string algo_name(ConvAlgo algo)
+{
+	return algo == ConvAlgo::WINOGRAD_4X4 ? "WINOGRAD_4X4" : "WINOGRAD_2X2";
+}
+
+// Runs forward and backward of the case with the given algorithm on x and dy, and returns the
+// output and the input gradient.
+pair<MatXf, MatXf> run(const Case& c, ConvAlgo algo, int batch, const MatXf& kernel, const VecXf& bias,
+	const MatXf& x, const MatXf& dy)
+{
+	Conv2d conv(c.in_channels, c.out_channels, c.kernel_size, c.padding, "lecun_uniform");
+	conv.set_algorithm(algo);
+	if (algo != ConvAlgo::IM2COL) conv.set_workspace_limit(c.workspace);
+	conv.set_layer({ batch, c.in_channels, c.height, c.width });
+	vector<float> mem = place_buffers(conv);
+	conv.kernel = kernel;
+	conv.bias = bias;
+
+	MatXf in = x;
+	MapXf prev_out(in.data(), in.rows(), in.cols());
+	conv.forward(prev_out, true);
+	MatXf y = conv.output;
+
+	conv.zero_grad();
+	conv.delta = dy;
+	MatXf dx = MatXf::Zero(x.rows(), x.cols());
+	MapXf prev_delta(dx.data(), dx.rows(), dx.cols());
+	conv.backward(prev_out, prev_delta);
+	return { y, dx };
+}
+
+int main()
+{
+	int batch = 4;
+	size_t ws = 8 << 20;
+	vector<Case> cases = {
+		// F(2x2, 3x3), with every padding Winograd runs and one it falls back to IM2COL for (pad > k - 1)
+		{ ConvAlgo::WINOGRAD_2X2, 8, 16, 3, 0, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 8, 16, 3, 1, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 8, 16, 3, 2, 13, 11, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 8, 16, 3, 3, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 16, 8, 3, 1, 28, 28, 16 << 10 },
+		// F(4x4, 3x3), including outputs that are not a multiple of the tile
+		{ ConvAlgo::WINOGRAD_4X4, 8, 16, 3, 0, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_4X4, 8, 16, 3, 1, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_4X4, 8, 16, 3, 2, 15, 9, ws },
+		{ ConvAlgo::WINOGRAD_4X4, 8, 16, 3, 3, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_4X4, 16, 8, 3, 1, 28, 28, 16 << 10 },
+		// F(2x2, 5x5), selected by both algorithms for 5x5 kernels
+		{ ConvAlgo::WINOGRAD_2X2, 1, 6, 5, 2, 28, 28, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 6, 16, 5, 0, 14, 14, ws },
+		{ ConvAlgo::WINOGRAD_4X4, 6, 16, 5, 4, 13, 13, ws },
+		{ ConvAlgo::WINOGRAD_2X2, 6, 16, 5, 5, 14, 14, ws }
+	};
+
+	default_random_engine e(7);
+	int failures = 0;
+	for (const Case& c : cases) {
+		int oh = calc_outsize(c.height, c.kernel_size, 1, c.padding);
+		int ow = calc_outsize(c.width, c.kernel_size, 1, c.padding);
+		MatXf kernel(c.out_channels, c.in_channels * c.kernel_size * c.kernel_size);
+		VecXf bias(c.out_channels);
+		MatXf x(batch * c.in_channels, c.height * c.width);
+		MatXf dy(batch * c.out_channels, oh * ow);
+		fill_random(kernel.data(), kernel.size(), e);
+		fill_random(bias.data(), bias.size(), e);
+		fill_random(x.data(), x.size(), e);
+		fill_random(dy.data(), dy.size(), e);
+
+		pair<MatXf, MatXf> ref = run(c, ConvAlgo::IM2COL, batch, kernel, bias, x, dy);
+		pair<MatXf, MatXf> out = run(c, c.algo, batch, kernel, bias, x, dy);
+		float err_y = relative_error(out.first, ref.first);
+		float err_dx = relative_error(out.second, ref.second);
+		bool ok = err_y <= TOLERANCE && err_dx <= TOLERANCE;
+		failures += !ok;
+
+		cout << setw(12) << algo_name(c.algo) << "  " << c.in_channels << "->" << c.out_channels
+			<< " k" << c.kernel_size << " pad " << c.padding << " " << c.height << "x" << c.width
+			<< "  forward " << scientific << setprecision(2) << err_y
+			<< "  input gradient " << err_dx << (ok ? "  ok" : "  FAILED") << endl;
+	}
+
+	cout << failures << " of " << cases.size() << " cases exceed the tolerance of " << setprecision(0) << TOLERANCE << "." << endl;
+	return failures == 0 ? 0 : 1;
+}
\ No newline at end of file